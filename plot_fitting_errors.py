@@ -8,7 +8,7 @@ import sys
 
 def usage (arg0):
     print ("Usage: {} [filename.log] [--pdf] [--png]".format(arg0))
-    print ("Plots fitting errors for the given filename.")
+    print ("Plots fitting errors for the given filename (csv or binary log).")
     print ("--pdf     Save pdf of the plot as [filename].pdf")
     print ("--png     Save png of the plot as [filename].png")
     sys.exit(1)
@@ -31,7 +31,37 @@ if len(sys.argv) > 2:
             usage (sys.argv[0])
         index = index + 1
 
-data_array = numpy.genfromtxt(filename, delimiter=',', names=True)
+def read_binary_log (filename):
+    with open(filename, 'rb') as log_file:
+        log_file.read(len(binary_log_magic))
+        # the log is written in host byte order
+        marker_count = numpy.frombuffer(log_file.read(4), dtype='=u4')[0]
+        names = []
+        for i in range(marker_count):
+            name = b""
+            char = log_file.read(1)
+            while char != b"\0":
+                if char == b"":
+                    print ("Error: fitting log {} is truncated.".format(filename))
+                    sys.exit(1)
+                name = name + char
+                char = log_file.read(1)
+            names.append (name.decode('ascii'))
+
+        record_type = [('frame', '=i4'), ('steps', '=u4')] + [(name, '=f4') for name in names]
+        # a log of a fit that was canceled may end with an incomplete record
+        records = log_file.read()
+        record_size = numpy.dtype(record_type).itemsize
+        return numpy.frombuffer(records[:len(records) - len(records) % record_size], dtype=record_type)
+
+binary_log_magic = b"PUPFLOG1"
+with open(filename, 'rb') as log_file:
+    is_binary_log = log_file.read(len(binary_log_magic)) == binary_log_magic
+
+if is_binary_log:
+    data_array = read_binary_log (filename)
+else:
+    data_array = numpy.genfromtxt(filename, delimiter=',', names=True)
 
 figure = plt.figure(figsize=(13,4))
 
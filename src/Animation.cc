@@ -26,6 +26,7 @@
 #include <assert.h>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
 
 #include "Animation.h"
 #include "string_utils.h"
@@ -122,6 +123,39 @@ VectorNd Animation::getCurrentPose() const {
 	return (1. - frac) * iter->state + frac * next->state;
 }
 
+void Animation::getPoseAt (double time, size_t *key_index, VectorNd *pose) const {
+	if (keyFrames.size() == 0) {
+		cerr << "Error: cannot get pose: no keyframes defined" << endl;
+		abort();
+	}
+
+	if (keyFrames.size() == 1 || time <= keyFrames[0].time) {
+		*key_index = 0;
+		*pose = keyFrames[0].state;
+		return;
+	}
+
+	if (time >= keyFrames.rbegin()->time) {
+		*key_index = keyFrames.size() - 1;
+		*pose = keyFrames.rbegin()->state;
+		return;
+	}
+
+	size_t index = std::min (*key_index, keyFrames.size() - 2);
+	while (index > 0 && keyFrames[index].time > time) {
+		index--;
+	}
+	while (keyFrames[index + 1].time < time) {
+		index++;
+	}
+	*key_index = index;
+
+	const AnimationKeyFrame &key_frame = keyFrames[index];
+	const AnimationKeyFrame &next_key_frame = keyFrames[index + 1];
+	double frac = (time - key_frame.time) / (next_key_frame.time - key_frame.time);
+	*pose = (1. - frac) * key_frame.state + frac * next_key_frame.state;
+}
+
 double Animation::getFirstFrameTime() const {
 	if (keyFrames.size() == 0) {
 		cerr << "Error: cannot get time: no keyframes defined" << endl;
@@ -204,15 +238,19 @@ void Animation::saveToFile( const char* filename) const {
 	ofstream outfile (filename);
 
 	for (vector<AnimationKeyFrame>::const_iterator iter = keyFrames.begin(); iter != keyFrames.end(); iter++) {
-		outfile << iter->time << ", ";
-		for (size_t i = 0; i < iter->state.size(); i++) {
-			outfile << iter->state[i];
-			if (i != iter->state.size() - 1) {
-				outfile << ", ";
-			}
-		}
-		outfile << endl;
+		write_animation_pose (outfile, iter->time, iter->state);
 	}
 
 	outfile.close();
 }
+
+void write_animation_pose (std::ostream &stream, double time, const VectorNd &state) {
+	stream << time << ", ";
+	for (size_t i = 0; i < state.size(); i++) {
+		stream << state[i];
+		if (i != state.size() - 1) {
+			stream << ", ";
+		}
+	}
+	stream << "\n";
+}
@@ -27,6 +27,7 @@
 #define ANIMATION_H
 
 #include <vector>
+#include <iosfwd>
 
 #include "SimpleMath/SimpleMath.h"
 
@@ -53,6 +54,14 @@ struct Animation {
 	void addPose (double time, const VectorNd &states);
 	void setCurrentTime (double time);
 	VectorNd getCurrentPose () const;
+	/** Interpolates the pose at the given time (clamped to the times of the
+	 * first and last key frame) without modifying currentTime.
+	 *
+	 * The search for the key frames starts at key_index which is updated to
+	 * the key frame in front of the given time. Evaluating increasing times
+	 * with the same key_index therefore does not scan all key frames.
+	 */
+	void getPoseAt (double time, size_t *key_index, VectorNd *pose) const;
 
 	double getFirstFrameTime() const;
 	double getLastFrameTime() const;
@@ -65,5 +74,9 @@ struct Animation {
   const VectorNd getStateLine(const size_t _stateIdx) const;
 };
 
+/** Writes a pose as a line of the format used by Animation::saveToFile().
+ * Allows to write animations incrementally without keeping all poses. */
+void write_animation_pose (std::ostream &stream, double time, const VectorNd &state);
+
 /* ANIMATION_H */
 #endif 
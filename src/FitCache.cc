@@ -0,0 +1,202 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include "FitCache.h"
+#include "Scene.h"
+#include "MarkerData.h"
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <sys/stat.h>
+
+using namespace std;
+
+uint64_t hash_file (const char* filename) {
+	ifstream file (filename, ios::binary);
+	if (!file)
+		return 0;
+
+	uint64_t hash = FIT_CACHE_HASH_SEED;
+	std::vector<char> buffer (1 << 16);
+	while (file) {
+		file.read (&buffer[0], buffer.size());
+		hash = hash_bytes (&buffer[0], static_cast<size_t>(file.gcount()), hash);
+	}
+
+	return hash;
+}
+
+std::string get_fit_cache_key (uint64_t parameter_hash, MarkerData *marker_data) {
+	uint64_t data_hash = marker_data->getFileHash();
+	data_hash = hash_bytes (&marker_data->rotateZ, sizeof (marker_data->rotateZ), data_hash);
+
+	ostringstream key;
+	key << hex << setfill ('0') << setw (16) << parameter_hash << "-" << setw (16) << data_hash;
+
+	return key.str();
+}
+
+template <typename T>
+bool read_value (istream &stream, T *value) {
+	return static_cast<bool>(stream.read (reinterpret_cast<char*>(value), sizeof (T)));
+}
+
+template <typename T>
+void write_value (ostream &stream, const T &value) {
+	stream.write (reinterpret_cast<const char*>(&value), sizeof (T));
+}
+
+bool FitCache::open (const std::string &directory, const std::string &entry_key, int first_frame, unsigned int state_size, unsigned int marker_count) {
+	close();
+
+	if (mkdir (directory.c_str(), 0755) != 0 && errno != EEXIST) {
+		cerr << "Error: could not create fit cache directory " << directory << endl;
+		return false;
+	}
+
+	key = entry_key;
+	filename = directory + "/" + entry_key + ".fit";
+	firstFrame = first_frame;
+	stateSize = state_size;
+	markerCount = marker_count;
+	frames.clear();
+
+	ifstream entry (filename.c_str(), ios::binary);
+	bool layout_matches = false;
+	bool complete = false;
+
+	if (entry) {
+		char magic[sizeof (FIT_CACHE_MAGIC)] = { 0 };
+		uint32_t key_length = 0;
+		int32_t entry_first_frame = 0;
+		uint32_t entry_state_size = 0;
+		uint32_t entry_marker_count = 0;
+
+		entry.read (magic, strlen (FIT_CACHE_MAGIC));
+		if (entry && strcmp (magic, FIT_CACHE_MAGIC) == 0 && read_value (entry, &key_length) && key_length == key.size()) {
+			std::string stored_key (key_length, ' ');
+			entry.read (&stored_key[0], key_length);
+
+			layout_matches = entry
+				&& stored_key == key
+				&& read_value (entry, &entry_first_frame) && entry_first_frame == firstFrame
+				&& read_value (entry, &entry_state_size) && entry_state_size == stateSize
+				&& read_value (entry, &entry_marker_count) && entry_marker_count == markerCount;
+		}
+
+		FittedFrame frame;
+		frame.state.resize (stateSize);
+		frame.markerErrors.resize (markerCount);
+		uint32_t steps, success;
+
+		while (layout_matches) {
+			if (!read_value (entry, &steps)) {
+				// the end of the entry has to be the end of a record
+				complete = entry.gcount() == 0;
+				break;
+			}
+
+			if (!read_value (entry, &success)
+					|| !entry.read (reinterpret_cast<char*>(frame.state.data()), sizeof (double) * stateSize)
+					|| !entry.read (reinterpret_cast<char*>(frame.markerErrors.data()), sizeof (double) * markerCount))
+				break;
+
+			frame.steps = steps;
+			frame.success = (success != 0);
+			frames.push_back (frame);
+		}
+	}
+	entry.close();
+
+	// the entry is only appended to if it can be continued, otherwise it is
+	// rewritten with the frames that could be read
+	if (layout_matches && complete) {
+		file.open (filename.c_str(), ios::out | ios::binary | ios::app);
+	} else {
+		file.open (filename.c_str(), ios::out | ios::binary | ios::trunc);
+		if (file) {
+			writeHeader();
+			for (size_t i = 0; i < frames.size(); i++) {
+				writeFrame (frames[i]);
+			}
+		}
+	}
+
+	if (!file) {
+		cerr << "Error: could not write fit cache entry " << filename << endl;
+		frames.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void FitCache::close () {
+	if (file.is_open())
+		file.close();
+
+	key = "";
+	frames.clear();
+}
+
+void FitCache::addFrame (const FittedFrame &frame) {
+	assert (static_cast<unsigned int>(frame.state.size()) == stateSize);
+
+	frames.push_back (frame);
+	if (file.is_open())
+		writeFrame (frame);
+}
+
+void FitCache::flush () {
+	if (file.is_open())
+		file.flush();
+}
+
+void FitCache::writeHeader () {
+	file.write (FIT_CACHE_MAGIC, strlen (FIT_CACHE_MAGIC));
+	write_value (file, static_cast<uint32_t>(key.size()));
+	file.write (key.c_str(), key.size());
+	write_value (file, static_cast<int32_t>(firstFrame));
+	write_value (file, static_cast<uint32_t>(stateSize));
+	write_value (file, static_cast<uint32_t>(markerCount));
+}
+
+void FitCache::writeFrame (const FittedFrame &frame) {
+	write_value (file, static_cast<uint32_t>(frame.steps));
+	write_value (file, static_cast<uint32_t>(frame.success ? 1 : 0));
+	for (unsigned int i = 0; i < stateSize; i++) {
+		write_value (file, frame.state[i]);
+	}
+
+	// markers without data at this frame are stored with zero residual
+	for (size_t mi = 0; mi < markerCount; mi++) {
+		double error = mi < frame.markerErrors.size() ? frame.markerErrors[mi] : 0.;
+		write_value (file, error);
+	}
+}
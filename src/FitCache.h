@@ -0,0 +1,114 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#ifndef FIT_CACHE_H
+#define FIT_CACHE_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdint.h>
+
+#include "ModelFitter.h"
+
+/** Entry file of the fit cache: FIT_CACHE_MAGIC, uint32 key length, the
+ * key, int32 first frame, uint32 state size, uint32 marker count, followed
+ * by one record per frame (uint32 steps, uint32 success, float64 state
+ * values, float64 residual of each marker), all in host byte order. */
+#define FIT_CACHE_MAGIC "PUPFCAC1"
+
+/// number of frames after which a fit writes its results to the cache
+const int FIT_CACHE_BLOCK_FRAMES = 4096;
+
+const uint64_t FIT_CACHE_HASH_SEED = 14695981039346656037ULL;
+
+/** 64 bit FNV-1a hash of the given bytes. Pass the hash of preceding data
+ * as seed to hash data in several parts. */
+inline uint64_t hash_bytes (const void *bytes, size_t size, uint64_t hash = FIT_CACHE_HASH_SEED) {
+	const unsigned char *data = static_cast<const unsigned char*>(bytes);
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/** Hash of the contents of the given file (0 if it cannot be read). */
+uint64_t hash_file (const char* filename);
+
+/** Returns the key of the cache entry for fits of the given marker data
+ * with the given parameters (see ModelFitter::calcParameterHash()). */
+std::string get_fit_cache_key (uint64_t parameter_hash, MarkerData *marker_data);
+
+/** Entry of the on-disk cache of fitted frames.
+ *
+ * An entry contains the fits of consecutive frames starting at the first
+ * frame of the marker data. Its key is a hash of everything that
+ * influences the fit, i.e. the model, the marker data and the parameters
+ * of the fitter. Frames are appended as they are fitted so that a fit that
+ * was canceled or crashed can be resumed after the last written frame.
+ */
+struct FitCache {
+	FitCache() :
+		firstFrame (0),
+		stateSize (0),
+		markerCount (0)
+	{}
+	~FitCache() {
+		close();
+	}
+
+	/** Opens the entry <directory>/<key>.fit (the directory is created if
+	 * needed) and reads the frames it contains. Entries with a different
+	 * layout and incomplete records at the end of the entry are discarded.
+	 * Returns false if the entry cannot be written.
+	 */
+	bool open (const std::string &directory, const std::string &key, int first_frame, unsigned int state_size, unsigned int marker_count);
+	void close ();
+	bool isOpen () const {
+		return file.is_open();
+	}
+
+	/** Appends the fit of the frame that follows the cached frames. */
+	void addFrame (const FittedFrame &frame);
+	/** Writes the added frames to disk. */
+	void flush ();
+
+	std::string key;
+	std::string filename;
+	int firstFrame;
+	unsigned int stateSize;
+	unsigned int markerCount;
+	/// cached frames starting at firstFrame
+	std::vector<FittedFrame> frames;
+
+	private:
+		void writeHeader ();
+		void writeFrame (const FittedFrame &frame);
+
+		std::ofstream file;
+};
+
+/* FIT_CACHE_H */
+#endif
@@ -0,0 +1,172 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include "FittingLog.h"
+
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+
+using namespace std;
+
+bool FittingLog::open (const char* log_filename, FittingLogFormat log_format, const std::vector<std::string> &marker_names, bool append) {
+	close();
+
+	if (log_format == FittingLogNone)
+		return true;
+
+	ios::openmode mode = ios::out;
+	if (log_format == FittingLogBinary)
+		mode |= ios::binary;
+	if (append)
+		mode |= ios::app;
+
+	file.open (log_filename, mode);
+	if (!file) {
+		cerr << "Error: could not open fitting log " << log_filename << endl;
+		return false;
+	}
+
+	filename = log_filename;
+	format = log_format;
+	markerCount = marker_names.size();
+
+	if (!append) {
+		if (format == FittingLogCSV) {
+			file << "frame, steps, ";
+			for (size_t i = 0; i < marker_names.size(); i++) {
+				file << marker_names[i];
+				if (i != marker_names.size() - 1)
+					file << ", ";
+			}
+			file << "\n";
+		} else {
+			uint32_t marker_count = markerCount;
+			file.write (FITTING_LOG_MAGIC, strlen (FITTING_LOG_MAGIC));
+			file.write (reinterpret_cast<const char*>(&marker_count), sizeof (marker_count));
+			for (size_t i = 0; i < marker_names.size(); i++) {
+				file.write (marker_names[i].c_str(), marker_names[i].size() + 1);
+			}
+		}
+	}
+
+	buffer.reserve (FITTING_LOG_BUFFER_FRAMES * (markerCount + 2));
+	writerDone = false;
+	writer = std::thread (&FittingLog::writerLoop, this);
+
+	return true;
+}
+
+void FittingLog::close () {
+	if (format == FittingLogNone)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		if (buffer.size() > 0) {
+			pending.push_back (std::vector<double>());
+			pending.back().swap (buffer);
+		}
+		writerDone = true;
+	}
+	condition.notify_one();
+	writer.join();
+
+	file.close();
+	format = FittingLogNone;
+}
+
+void FittingLog::addFrame (int frame, unsigned int steps, const std::vector<double> &marker_errors) {
+	if (format == FittingLogNone)
+		return;
+
+	assert (marker_errors.size() == markerCount || marker_errors.size() == 0);
+
+	buffer.push_back (static_cast<double>(frame));
+	buffer.push_back (static_cast<double>(steps));
+	for (size_t i = 0; i < markerCount; i++) {
+		buffer.push_back (i < marker_errors.size() ? marker_errors[i] : 0.);
+	}
+
+	if (buffer.size() >= FITTING_LOG_BUFFER_FRAMES * (markerCount + 2)) {
+		{
+			std::lock_guard<std::mutex> lock (mutex);
+			pending.push_back (std::vector<double>());
+			pending.back().swap (buffer);
+		}
+		condition.notify_one();
+		buffer.reserve (FITTING_LOG_BUFFER_FRAMES * (markerCount + 2));
+	}
+}
+
+void FittingLog::writerLoop () {
+	std::vector<double> current;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock (mutex);
+			while (pending.size() == 0 && !writerDone)
+				condition.wait (lock);
+
+			if (pending.size() == 0)
+				break;
+
+			current.swap (pending.front());
+			pending.pop_front();
+		}
+
+		writeBuffer (current);
+		current.clear();
+	}
+
+	file.flush();
+}
+
+void FittingLog::writeBuffer (const std::vector<double> &frames) {
+	size_t record_size = markerCount + 2;
+
+	for (size_t offset = 0; offset + record_size <= frames.size(); offset += record_size) {
+		int32_t frame = static_cast<int32_t>(frames[offset]);
+		uint32_t steps = static_cast<uint32_t>(frames[offset + 1]);
+
+		if (format == FittingLogCSV) {
+			file << frame << ", " << steps << ", ";
+			for (size_t mi = 0; mi < markerCount; mi++) {
+				file << frames[offset + 2 + mi];
+				if (mi != markerCount - 1)
+					file << ", ";
+			}
+			file << "\n";
+		} else {
+			file.write (reinterpret_cast<const char*>(&frame), sizeof (frame));
+			file.write (reinterpret_cast<const char*>(&steps), sizeof (steps));
+			for (size_t mi = 0; mi < markerCount; mi++) {
+				float residual = static_cast<float>(frames[offset + 2 + mi]);
+				file.write (reinterpret_cast<const char*>(&residual), sizeof (residual));
+			}
+		}
+	}
+}
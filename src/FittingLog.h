@@ -0,0 +1,102 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#ifndef FITTING_LOG_H
+#define FITTING_LOG_H
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/** File format of the residual log of the model fitter. */
+enum FittingLogFormat {
+	/// no log is written
+	FittingLogNone = 0,
+	/// "frame, steps, <marker names>" header and one line per frame
+	FittingLogCSV,
+	/// FITTING_LOG_MAGIC, uint32 marker count, the null terminated marker
+	/// names, followed by one record per frame (int32 frame, uint32 steps,
+	/// float32 residual of each marker), all in host byte order
+	FittingLogBinary
+};
+
+#define FITTING_LOG_MAGIC "PUPFLOG1"
+
+/// number of frames that are collected before they are handed to the writer
+const size_t FITTING_LOG_BUFFER_FRAMES = 4096;
+
+/** Log of the steps and marker residuals of fitted frames.
+ *
+ * Frames are collected in large buffers which are formatted and written
+ * by a background thread so that fitting is not slowed down by file
+ * output.
+ */
+struct FittingLog {
+	FittingLog() :
+		format (FittingLogNone),
+		markerCount (0),
+		writerDone (false)
+	{}
+	~FittingLog() {
+		close();
+	}
+
+	/** Opens the log and starts the writer thread. If append is true the
+	 * frames are added to an existing file without a new header. */
+	bool open (const char* filename, FittingLogFormat format, const std::vector<std::string> &marker_names, bool append);
+	/** Writes all pending frames and closes the file. */
+	void close ();
+	bool isOpen () const {
+		return format != FittingLogNone;
+	}
+
+	void addFrame (int frame, unsigned int steps, const std::vector<double> &marker_errors);
+
+	FittingLogFormat format;
+	std::string filename;
+	unsigned int markerCount;
+
+	private:
+		void writerLoop ();
+		void writeBuffer (const std::vector<double> &buffer);
+
+		std::ofstream file;
+		std::thread writer;
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool writerDone;
+
+		/// frames that are being collected (frame, steps, residuals)
+		std::vector<double> buffer;
+		/// full buffers waiting for the writer thread
+		std::deque<std::vector<double> > pending;
+};
+
+/* FITTING_LOG_H */
+#endif
@@ -0,0 +1,1042 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include "InverseKinematics.h"
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+typedef RigidBodyDynamics::Math::Vector3d rbdlVector3d;
+typedef RigidBodyDynamics::Math::VectorNd rbdlVectorNd;
+typedef RigidBodyDynamics::Math::MatrixNd rbdlMatrixNd;
+
+void IKWorkspace::resize (unsigned int marker_count, unsigned int dof_count) {
+	if (marker_count == markerCount && dof_count == dofCount)
+		return;
+
+	markerCount = marker_count;
+	dofCount = dof_count;
+	allocations++;
+
+	unsigned int residual_count = 3 * marker_count;
+
+	J = rbdlMatrixNd::Zero (residual_count, dof_count);
+	G = rbdlMatrixNd::Zero (3, dof_count);
+	e = rbdlVectorNd::Zero (residual_count);
+	point_base.resize (marker_count);
+	S_base = rbdlMatrixNd::Zero (6, dof_count);
+
+	damping = rbdlVectorNd::Zero (residual_count);
+	J_weighted = rbdlMatrixNd::Zero (residual_count, dof_count);
+
+	A_task = rbdlMatrixNd::Zero (residual_count, residual_count);
+	llt_task = Eigen::LLT<rbdlMatrixNd> (residual_count);
+	ldlt_task = Eigen::LDLT<rbdlMatrixNd> (residual_count);
+	qr_task = Eigen::ColPivHouseholderQR<rbdlMatrixNd> (residual_count, residual_count);
+	x_task = rbdlVectorNd::Zero (residual_count);
+	scratch_task = rbdlVectorNd::Zero (residual_count);
+
+	A_joint = rbdlMatrixNd::Zero (dof_count, dof_count);
+	llt_joint = Eigen::LLT<rbdlMatrixNd> (dof_count);
+	ldlt_joint = Eigen::LDLT<rbdlMatrixNd> (dof_count);
+	qr_joint = Eigen::ColPivHouseholderQR<rbdlMatrixNd> (dof_count, dof_count);
+	rhs_joint = rbdlVectorNd::Zero (dof_count);
+	scratch_joint = rbdlVectorNd::Zero (dof_count);
+
+	delta_theta = rbdlVectorNd::Zero (dof_count);
+	gradient = rbdlVectorNd::Zero (dof_count);
+	q_trial = rbdlVectorNd::Zero (dof_count);
+	e_trial = rbdlVectorNd::Zero (residual_count);
+	householder = rbdlVectorNd::Zero (1);
+
+	q_jacobian = rbdlVectorNd::Zero (dof_count);
+	p_jacobian = rbdlVectorNd::Zero (residual_count);
+	jacobian_targets.assign (marker_count, false);
+	jacobianValid = false;
+
+	delete fixedJointSystem;
+	fixedJointSystem = create_fixed_joint_system (dof_count);
+
+	// forces the recomputation of the sparsity structure
+	structure_body_ids.clear();
+}
+
+/** Solves the factorized square system for x.
+ *
+ * Equivalent to x = qr.solve (rhs) but uses the preallocated scratch
+ * vector instead of allocating temporaries.
+ */
+void qr_solve (const Eigen::ColPivHouseholderQR<rbdlMatrixNd> &qr, const rbdlVectorNd &rhs, rbdlVectorNd &scratch, rbdlVectorNd &householder, rbdlVectorNd &x) {
+	int n = rhs.size();
+	int rank = qr.nonzeroPivots();
+
+	// scratch = Q^T rhs
+	scratch = rhs;
+	for (int k = 0; k < rank; k++) {
+		scratch.tail(n - k).applyHouseholderOnTheLeft (qr.matrixQR().col(k).tail(n - k - 1), qr.hCoeffs()[k], householder.data());
+	}
+
+	qr.matrixQR().topLeftCorner (rank, rank).triangularView<Eigen::Upper>().solveInPlace (scratch.head(rank));
+	scratch.tail (n - rank).setZero();
+
+	for (int i = 0; i < n; i++) {
+		x[qr.colsPermutation().indices()[i]] = scratch[i];
+	}
+}
+
+/** Solves the symmetric positive definite system A x = rhs with the given
+ * decomposition and falls back to QR if A is not positive definite. */
+void solve_spd (
+		const rbdlMatrixNd &A,
+		const rbdlVectorNd &rhs,
+		IKLinearSolver linear_solver,
+		Eigen::LLT<rbdlMatrixNd> &llt,
+		Eigen::LDLT<rbdlMatrixNd> &ldlt,
+		Eigen::ColPivHouseholderQR<rbdlMatrixNd> &qr,
+		rbdlVectorNd &scratch,
+		rbdlVectorNd &householder,
+		rbdlVectorNd &x) {
+	if (linear_solver == IKSolverLLT) {
+		llt.compute (A);
+		if (llt.info() == Eigen::Success) {
+			x = llt.solve (rhs);
+			return;
+		}
+	} else if (linear_solver == IKSolverLDLT) {
+		ldlt.compute (A);
+		if (ldlt.info() == Eigen::Success && ldlt.isPositive()) {
+			x = ldlt.solve (rhs);
+			return;
+		}
+	}
+
+	qr.compute (A);
+	qr_solve (qr, rhs, scratch, householder, x);
+}
+
+/** Computes J^T W J + I and J^T W e of the joint space form using only
+ * the nonzero columns of each marker. */
+template <typename MatrixType, typename VectorType>
+void calc_sparse_joint_space_system (const IKWorkspace &workspace, MatrixType &A, VectorType &rhs) {
+	A.setZero();
+	rhs.setZero();
+
+	for (unsigned int k = 0; k < workspace.markerCount; k++) {
+		unsigned int begin = workspace.dof_offsets[k];
+		unsigned int end = workspace.dof_offsets[k + 1];
+
+		for (unsigned int r = k * 3; r < k * 3 + 3; r++) {
+			double w = 1. / workspace.damping[r];
+
+			for (unsigned int a = begin; a < end; a++) {
+				unsigned int col_a = workspace.dof_indices[a];
+				double wJ = w * workspace.J(r, col_a);
+
+				rhs[col_a] += wJ * workspace.e[r];
+
+				// only the lower triangle as the indices are ascending
+				for (unsigned int b = begin; b <= a; b++) {
+					unsigned int col_b = workspace.dof_indices[b];
+					A(col_a, col_b) += wJ * workspace.J(r, col_b);
+				}
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < workspace.dofCount; i++) {
+		A(i, i) += 1.;
+		for (unsigned int j = 0; j < i; j++) {
+			A(j, i) = A(i, j);
+		}
+	}
+}
+
+template <typename MatrixType, typename VectorType>
+void calc_dense_joint_space_system (IKWorkspace &workspace, MatrixType &A, VectorType &rhs) {
+	workspace.J_weighted = workspace.damping.cwiseInverse().asDiagonal() * workspace.J;
+	A.noalias() = workspace.J.transpose() * workspace.J_weighted;
+	A.diagonal().array() += 1.;
+	rhs.noalias() = workspace.J_weighted.transpose() * workspace.e;
+}
+
+template <int DofCount>
+struct IKFixedJointSystemImpl : public IKFixedJointSystem {
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+	typedef Eigen::Matrix<double, DofCount, DofCount> MatrixType;
+	typedef Eigen::Matrix<double, DofCount, 1> VectorType;
+
+	virtual bool solve (IKWorkspace &workspace, IKLinearSolver linear_solver, bool sparse_jacobian) {
+		if (sparse_jacobian)
+			calc_sparse_joint_space_system (workspace, A, rhs);
+		else
+			calc_dense_joint_space_system (workspace, A, rhs);
+
+		if (linear_solver == IKSolverLLT) {
+			llt.compute (A);
+			if (llt.info() == Eigen::Success) {
+				x = llt.solve (rhs);
+				workspace.delta_theta = x;
+				return true;
+			}
+		} else if (linear_solver == IKSolverLDLT) {
+			ldlt.compute (A);
+			if (ldlt.info() == Eigen::Success && ldlt.isPositive()) {
+				x = ldlt.solve (rhs);
+				workspace.delta_theta = x;
+				return true;
+			}
+		}
+
+		// QR and the fallback for indefinite systems use the dynamic storage
+		workspace.A_joint = A;
+		workspace.rhs_joint = rhs;
+		return false;
+	}
+
+	MatrixType A;
+	VectorType rhs;
+	VectorType x;
+	Eigen::LLT<MatrixType> llt;
+	Eigen::LDLT<MatrixType> ldlt;
+};
+
+IKFixedJointSystem* create_fixed_joint_system (unsigned int dof_count) {
+	switch (dof_count) {
+		// model.lua and the HeiMan models
+		case 34: return new IKFixedJointSystemImpl<34>();
+		default: break;
+	}
+
+	return NULL;
+}
+
+/** Computes J J^T + diag(damping) of the task space form. Two markers
+ * only share the degrees of freedom of their common ancestors which are
+ * the common beginning of their (ascending) column lists. */
+void calc_sparse_task_space_system (IKWorkspace &workspace) {
+	for (unsigned int k = 0; k < workspace.markerCount; k++) {
+		unsigned int begin_k = workspace.dof_offsets[k];
+		unsigned int end_k = workspace.dof_offsets[k + 1];
+
+		for (unsigned int l = 0; l <= k; l++) {
+			unsigned int begin_l = workspace.dof_offsets[l];
+			unsigned int end_l = workspace.dof_offsets[l + 1];
+
+			unsigned int common = 0;
+			while (begin_k + common < end_k
+					&& begin_l + common < end_l
+					&& workspace.dof_indices[begin_k + common] == workspace.dof_indices[begin_l + common])
+				common++;
+
+			for (unsigned int r = k * 3; r < k * 3 + 3; r++) {
+				for (unsigned int s = l * 3; s < l * 3 + 3; s++) {
+					double value = 0.;
+					for (unsigned int c = begin_k; c < begin_k + common; c++) {
+						unsigned int col = workspace.dof_indices[c];
+						value += workspace.J(r, col) * workspace.J(s, col);
+					}
+
+					workspace.A_task(r, s) = value;
+					workspace.A_task(s, r) = value;
+				}
+			}
+		}
+	}
+
+	workspace.A_task.diagonal() += workspace.damping;
+}
+
+/** Computes delta_theta = J^T x_task using only the nonzero columns. */
+void calc_sparse_jacobian_transpose_product (IKWorkspace &workspace) {
+	workspace.delta_theta.setZero();
+
+	for (unsigned int k = 0; k < workspace.markerCount; k++) {
+		for (unsigned int r = k * 3; r < k * 3 + 3; r++) {
+			for (unsigned int a = workspace.dof_offsets[k]; a < workspace.dof_offsets[k + 1]; a++) {
+				unsigned int col = workspace.dof_indices[a];
+				workspace.delta_theta[col] += workspace.J(r, col) * workspace.x_task[r];
+			}
+		}
+	}
+}
+
+void calc_damped_step (
+		IKWorkspace &workspace,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian
+		) {
+	if (system_form == IKSystemAuto) {
+		if (workspace.dofCount < 3 * workspace.markerCount)
+			system_form = IKSystemJointSpace;
+		else
+			system_form = IKSystemTaskSpace;
+	}
+
+	// the joint space form needs the inverse of the damping
+	if (system_form == IKSystemJointSpace && workspace.damping.minCoeff() <= 0.)
+		system_form = IKSystemTaskSpace;
+
+	if (system_form == IKSystemTaskSpace) {
+		if (sparse_jacobian) {
+			calc_sparse_task_space_system (workspace);
+		} else {
+			workspace.A_task.noalias() = workspace.J * workspace.J.transpose();
+			workspace.A_task.diagonal() += workspace.damping;
+		}
+
+		solve_spd (workspace.A_task, workspace.e, linear_solver, workspace.llt_task, workspace.ldlt_task, workspace.qr_task, workspace.scratch_task, workspace.householder, workspace.x_task);
+
+		if (sparse_jacobian) {
+			calc_sparse_jacobian_transpose_product (workspace);
+		} else {
+			workspace.delta_theta.noalias() = workspace.J.transpose() * workspace.x_task;
+		}
+	} else {
+		if (workspace.useFixedSize && workspace.fixedJointSystem) {
+			if (workspace.fixedJointSystem->solve (workspace, linear_solver, sparse_jacobian))
+				return;
+
+			// the fixed size system copied its matrices to A_joint and rhs_joint
+			workspace.qr_joint.compute (workspace.A_joint);
+			qr_solve (workspace.qr_joint, workspace.rhs_joint, workspace.scratch_joint, workspace.householder, workspace.delta_theta);
+			return;
+		}
+
+		if (sparse_jacobian) {
+			calc_sparse_joint_space_system (workspace, workspace.A_joint, workspace.rhs_joint);
+		} else {
+			calc_dense_joint_space_system (workspace, workspace.A_joint, workspace.rhs_joint);
+		}
+
+		solve_spd (workspace.A_joint, workspace.rhs_joint, linear_solver, workspace.llt_joint, workspace.ldlt_joint, workspace.qr_joint, workspace.scratch_joint, workspace.householder, workspace.delta_theta);
+	}
+}
+
+/** Computes the columns of J that can be nonzero for each marker from the
+ * parent structure of the model. Does nothing if the bodies did not
+ * change. */
+void update_jacobian_structure (
+		RigidBodyDynamics::Model &model,
+		const std::vector<unsigned int>& body_id,
+		IKWorkspace &workspace) {
+	if (workspace.structure_body_ids == body_id)
+		return;
+
+	workspace.structure_body_ids = body_id;
+	workspace.jacobianValid = false;
+	workspace.dof_offsets.clear();
+	workspace.dof_indices.clear();
+
+	// columns outside of the structure are never written again
+	workspace.J.setZero();
+
+	for (unsigned int k = 0; k < body_id.size(); k++) {
+		workspace.dof_offsets.push_back (workspace.dof_indices.size());
+
+		unsigned int j = body_id[k];
+		if (model.IsFixedBodyId (j))
+			j = model.mFixedBodies[j - model.fixed_body_discriminator].mMovableParent;
+
+		while (j != 0) {
+			for (unsigned int di = 0; di < model.mJoints[j].mDoFCount; di++) {
+				workspace.dof_indices.push_back (model.mJoints[j].q_index + di);
+			}
+			j = model.lambda[j];
+		}
+
+		std::sort (workspace.dof_indices.begin() + workspace.dof_offsets[k], workspace.dof_indices.end());
+	}
+
+	workspace.dof_offsets.push_back (workspace.dof_indices.size());
+
+	// the batched Jacobian computation supports all joints except custom
+	// joints
+	workspace.batchKinematics = true;
+	for (unsigned int j = 1; j < model.mJoints.size(); j++) {
+		if (model.mJoints[j].mJointType == RigidBodyDynamics::JointTypeCustom
+				|| (model.mJoints[j].mDoFCount != 1 && model.mJoints[j].mDoFCount != 3))
+			workspace.batchKinematics = false;
+	}
+}
+
+void calc_points_base_coordinates (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Q,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		std::vector<rbdlVector3d>& point_base,
+		bool update_kinematics) {
+	if (update_kinematics)
+		UpdateKinematicsCustom (model, &Q, NULL, NULL);
+
+	point_base.resize (body_id.size());
+
+	// with updated kinematics this only uses the base transformation of
+	// each body and does not traverse the tree
+	for (unsigned int k = 0; k < body_id.size(); k++) {
+		point_base[k] = CalcBodyToBaseCoordinates (model, Q, body_id[k], body_point[k], false);
+	}
+}
+
+/** Transforms the motion subspaces of all joints into base coordinates
+ * using the transformations of the last kinematics update. */
+void calc_base_motion_subspaces (RigidBodyDynamics::Model &model, IKWorkspace &workspace) {
+	for (unsigned int j = 1; j < model.mJoints.size(); j++) {
+		unsigned int q_index = model.mJoints[j].q_index;
+		RigidBodyDynamics::Math::SpatialTransform X_base_inv = model.X_base[j].inverse();
+
+		if (model.mJoints[j].mDoFCount == 1) {
+			workspace.S_base.col(q_index) = X_base_inv.apply (model.S[j]);
+		} else if (model.mJoints[j].mDoFCount == 3) {
+			for (unsigned int i = 0; i < 3; i++) {
+				workspace.S_base.col(q_index + i) = X_base_inv.apply (RigidBodyDynamics::Math::SpatialVector (model.multdof3_S[j].col(i)));
+			}
+		}
+	}
+}
+
+/** Computes the Jacobian and residuals of all markers at Qres. Rows of
+ * markers without valid targets are zero.
+ *
+ * Instead of calling CalcPointJacobian() for each marker, which walks
+ * from the body to the root every time, the motion subspaces of all
+ * joints are transformed once into base coordinates. The Jacobian column
+ * of a degree of freedom for a point p is then v + omega x p.
+ */
+void calc_marker_jacobian_residuals (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qres,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		IKWorkspace &workspace,
+		bool update_kinematics = true) {
+	calc_points_base_coordinates (model, Qres, body_id, body_point, workspace.point_base, update_kinematics);
+
+	if (workspace.batchKinematics)
+		calc_base_motion_subspaces (model, workspace);
+
+	for (unsigned int k = 0; k < body_id.size(); k++) {
+		unsigned int begin = workspace.dof_offsets[k];
+		unsigned int end = workspace.dof_offsets[k + 1];
+
+		// columns outside of the sparsity structure are always zero
+		if (!target_valid[k]) {
+			for (unsigned int a = begin; a < end; a++) {
+				workspace.J.block<3, 1>(k * 3, workspace.dof_indices[a]).setZero();
+			}
+			workspace.e.segment<3>(k * 3).setZero();
+			continue;
+		}
+
+		const rbdlVector3d &point_base = workspace.point_base[k];
+
+		if (workspace.batchKinematics) {
+			for (unsigned int a = begin; a < end; a++) {
+				unsigned int col = workspace.dof_indices[a];
+				rbdlVector3d omega = workspace.S_base.block<3, 1>(0, col);
+				rbdlVector3d v = workspace.S_base.block<3, 1>(3, col);
+
+				workspace.J.block<3, 1>(k * 3, col) = v + omega.cross (point_base);
+			}
+		} else {
+			workspace.G.setZero();
+			CalcPointJacobian (model, Qres, body_id[k], body_point[k], workspace.G, false);
+
+			for (unsigned int a = begin; a < end; a++) {
+				unsigned int col = workspace.dof_indices[a];
+				workspace.J.block<3, 1>(k * 3, col) = workspace.G.col(col);
+			}
+		}
+
+		workspace.e.segment<3>(k * 3) = target_pos[k] - point_base;
+	}
+}
+
+/** Computes only the residuals of all markers at Q. With update_kinematics
+ * false the kinematics must already be updated at Q. */
+void calc_marker_residuals (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Q,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		IKWorkspace &workspace,
+		rbdlVectorNd &e,
+		bool update_kinematics = true) {
+	calc_points_base_coordinates (model, Q, body_id, body_point, workspace.point_base, update_kinematics);
+
+	for (unsigned int k = 0; k < body_id.size(); k++) {
+		if (target_valid[k])
+			e.segment<3>(k * 3) = target_pos[k] - workspace.point_base[k];
+		else
+			e.segment<3>(k * 3).setZero();
+	}
+}
+
+/// minimal ratio of the actual and the predicted decrease of the error
+/// of a step with a Broyden updated Jacobian before the exact Jacobian is
+/// computed
+#define IK_BROYDEN_STALL_RATIO 0.25
+
+/** Computes the change of the position of marker k that the Jacobian of
+ * the last evaluation predicts for the change of the state from
+ * workspace.q_jacobian to Q. */
+rbdlVector3d calc_predicted_marker_motion (const IKWorkspace &workspace, const rbdlVectorNd &Q, unsigned int k) {
+	rbdlVector3d motion (0., 0., 0.);
+
+	for (unsigned int a = workspace.dof_offsets[k]; a < workspace.dof_offsets[k + 1]; a++) {
+		unsigned int col = workspace.dof_indices[a];
+		motion += workspace.J.block<3, 1>(k * 3, col) * (Q[col] - workspace.q_jacobian[col]);
+	}
+
+	return motion;
+}
+
+/** Computes the residuals and the Jacobian of all markers at Qres like
+ * calc_marker_jacobian_residuals().
+ *
+ * If workspace.jacobianUpdateInterval is larger than 1 the exact Jacobian
+ * is only computed if
+ *   - there is no previous Jacobian or the interval has passed,
+ *   - the valid targets changed since the last evaluation or
+ *   - the error stalls, i.e. the step from the last evaluation of the
+ *     current IK call decreased the error by less than
+ *     IK_BROYDEN_STALL_RATIO times the decrease predicted by the Jacobian.
+ * Otherwise only the marker positions are computed and the Jacobian of
+ * the last evaluation (which may stem from the previous frame) is updated
+ * using Schubert's sparse variant of Broyden's method: the three rows of
+ * each marker are corrected so that they map the change of the state
+ * within the sparsity structure of the marker onto the change of its
+ * position.
+ */
+void update_marker_jacobian_residuals (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qres,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		IKWorkspace &workspace,
+		bool update_kinematics = true) {
+	// the update requires that the state has one value per degree of freedom
+	if (workspace.jacobianUpdateInterval <= 1 || Qres.size() != workspace.dofCount) {
+		calc_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace, update_kinematics);
+		workspace.exactJacobians++;
+		return;
+	}
+
+	bool exact = !workspace.jacobianValid
+		|| workspace.jacobianAge + 1 >= workspace.jacobianUpdateInterval
+		|| workspace.jacobian_targets != target_valid;
+
+	if (!exact) {
+		calc_marker_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace, workspace.e, update_kinematics);
+		update_kinematics = false;
+
+		// within an IK call the targets are the same as at the last evaluation
+		if (workspace.jacobianError >= 0.) {
+			double predicted_error = 0.;
+			for (unsigned int k = 0; k < body_id.size(); k++) {
+				if (target_valid[k]) {
+					rbdlVector3d predicted_pos = workspace.p_jacobian.segment<3>(k * 3) + calc_predicted_marker_motion (workspace, Qres, k);
+					predicted_error += (target_pos[k] - predicted_pos).squaredNorm();
+				}
+			}
+
+			double predicted_decrease = workspace.jacobianError - predicted_error;
+			double actual_decrease = workspace.jacobianError - workspace.e.squaredNorm();
+			exact = actual_decrease < IK_BROYDEN_STALL_RATIO * predicted_decrease;
+		}
+	}
+
+	if (exact) {
+		calc_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace, update_kinematics);
+		workspace.jacobianAge = 0;
+		workspace.exactJacobians++;
+	} else {
+		for (unsigned int k = 0; k < body_id.size(); k++) {
+			if (!target_valid[k])
+				continue;
+
+			unsigned int begin = workspace.dof_offsets[k];
+			unsigned int end = workspace.dof_offsets[k + 1];
+
+			double delta_norm_squared = 0.;
+			for (unsigned int a = begin; a < end; a++) {
+				double d = Qres[workspace.dof_indices[a]] - workspace.q_jacobian[workspace.dof_indices[a]];
+				delta_norm_squared += d * d;
+			}
+
+			// the marker did not move
+			if (delta_norm_squared < 1.0e-24)
+				continue;
+
+			// difference of the actual and the predicted change of the position
+			rbdlVector3d correction = workspace.point_base[k] - workspace.p_jacobian.segment<3>(k * 3) - calc_predicted_marker_motion (workspace, Qres, k);
+
+			correction /= delta_norm_squared;
+			for (unsigned int a = begin; a < end; a++) {
+				unsigned int col = workspace.dof_indices[a];
+				workspace.J.block<3, 1>(k * 3, col) += correction * (Qres[col] - workspace.q_jacobian[col]);
+			}
+		}
+
+		workspace.jacobianAge++;
+		workspace.broydenUpdates++;
+	}
+
+	workspace.jacobianValid = true;
+	workspace.jacobianError = workspace.e.squaredNorm();
+	workspace.jacobian_targets = target_valid;
+	workspace.q_jacobian = Qres;
+	for (unsigned int k = 0; k < body_id.size(); k++) {
+		workspace.p_jacobian.segment<3>(k * 3) = workspace.point_base[k];
+	}
+}
+
+/** Returns the index of the unit coordinate axis (0, 1 or 2) of v and its
+ * sign or -1 if v is not a coordinate axis. */
+int get_coordinate_axis (const rbdlVector3d &v, double *sign) {
+	for (int i = 0; i < 3; i++) {
+		if (fabs (fabs (v[i]) - 1.) < 1.0e-12 && v.squaredNorm() - v[i] * v[i] < 1.0e-12) {
+			*sign = v[i] > 0. ? 1. : -1.;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/** Returns the angle that is equivalent to angle (modulo 2 pi) and
+ * closest to reference. */
+double get_closest_angle (double angle, double reference) {
+	return angle + 2. * M_PI * floor ((reference - angle) / (2. * M_PI) + 0.5);
+}
+
+bool RootFreeFlyer::initialize (RigidBodyDynamics::Model &model) {
+	valid = false;
+
+	if (model.mJoints.size() < 7)
+		return false;
+
+	for (unsigned int k = 0; k < 6; k++) {
+		unsigned int j = k + 1;
+
+		if (model.lambda[j] != k
+				|| model.mJoints[j].mDoFCount != 1
+				|| model.mJoints[j].q_index != k
+				|| !model.X_T[j].E.isIdentity (1.0e-12)
+				|| (j > 1 && !model.X_T[j].r.isZero (1.0e-12)))
+			return false;
+
+		// translations along and then rotations about coordinate axes
+		rbdlVector3d rotation = model.S[j].head<3>();
+		rbdlVector3d translation = model.S[j].tail<3>();
+		if (k < 3) {
+			if (!rotation.isZero())
+				return false;
+			axes[k] = get_coordinate_axis (translation, &signs[k]);
+		} else {
+			if (!translation.isZero())
+				return false;
+			axes[k] = get_coordinate_axis (rotation, &signs[k]);
+		}
+
+		if (axes[k] < 0)
+			return false;
+	}
+
+	// consecutive rotations about the same axis do not form Euler angles
+	if (axes[3] == axes[4] || axes[4] == axes[5])
+		return false;
+
+	bodyId = 6;
+	offset = model.X_T[1].r;
+	valid = true;
+
+	return true;
+}
+
+bool calc_root_pose_initialization (
+		RigidBodyDynamics::Model &model,
+		const RootFreeFlyer &root,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		rbdlVectorNd &Q) {
+	if (!root.valid)
+		return false;
+
+	// marker positions in root coordinates and their targets
+	rbdlVector3d points[IK_ROOT_MAX_MARKERS];
+	rbdlVector3d targets[IK_ROOT_MAX_MARKERS];
+	unsigned int count = 0;
+
+	for (unsigned int k = 0; k < body_id.size() && count < IK_ROOT_MAX_MARKERS; k++) {
+		if (!target_valid[k])
+			continue;
+
+		if (body_id[k] == root.bodyId) {
+			points[count] = body_point[k];
+		} else if (model.IsFixedBodyId (body_id[k])
+				&& model.mFixedBodies[body_id[k] - model.fixed_body_discriminator].mMovableParent == root.bodyId) {
+			const RigidBodyDynamics::Math::SpatialTransform &X_parent = model.mFixedBodies[body_id[k] - model.fixed_body_discriminator].mParentTransform;
+			points[count] = X_parent.E.transpose() * body_point[k] + X_parent.r;
+		} else {
+			continue;
+		}
+
+		targets[count] = target_pos[k];
+		count++;
+	}
+
+	if (count < 3)
+		return false;
+
+	rbdlVector3d points_center (rbdlVector3d::Zero());
+	rbdlVector3d targets_center (rbdlVector3d::Zero());
+	for (unsigned int i = 0; i < count; i++) {
+		points_center += points[i];
+		targets_center += targets[i];
+	}
+	points_center /= count;
+	targets_center /= count;
+
+	RigidBodyDynamics::Math::Matrix3d H (RigidBodyDynamics::Math::Matrix3d::Zero());
+	for (unsigned int i = 0; i < count; i++) {
+		H += (points[i] - points_center) * (targets[i] - targets_center).transpose();
+	}
+
+	Eigen::JacobiSVD<RigidBodyDynamics::Math::Matrix3d> svd (H, Eigen::ComputeFullU | Eigen::ComputeFullV);
+
+	// collinear markers do not determine the rotation
+	if (svd.singularValues()[1] < 1.0e-6 * svd.singularValues()[0])
+		return false;
+
+	// Kabsch: rotation that maps the points onto the targets
+	RigidBodyDynamics::Math::Matrix3d D (RigidBodyDynamics::Math::Matrix3d::Identity());
+	D(2, 2) = (svd.matrixV() * svd.matrixU().transpose()).determinant() > 0. ? 1. : -1.;
+	RigidBodyDynamics::Math::Matrix3d R = svd.matrixV() * D * svd.matrixU().transpose();
+	rbdlVector3d t = targets_center - R * points_center - root.offset;
+
+	for (unsigned int k = 0; k < 3; k++) {
+		Q[k] = root.signs[k] * t[root.axes[k]];
+	}
+
+	// R = R_0 (q_3) R_1 (q_4) R_2 (q_5) with the rotation axes of the root
+	rbdlVector3d angles = R.eulerAngles (root.axes[3], root.axes[4], root.axes[5]);
+
+	// both angle triples describe the same rotation, use the one that is
+	// closer to the current state
+	rbdlVector3d angles_alt (angles[0] + M_PI, M_PI - angles[1], angles[2] + M_PI);
+	if (root.axes[3] == root.axes[5])
+		angles_alt[1] = -angles[1];
+
+	double distance = 0.;
+	double distance_alt = 0.;
+	for (unsigned int k = 0; k < 3; k++) {
+		angles[k] = get_closest_angle (root.signs[k + 3] * angles[k], Q[k + 3]);
+		angles_alt[k] = get_closest_angle (root.signs[k + 3] * angles_alt[k], Q[k + 3]);
+		distance += fabs (angles[k] - Q[k + 3]);
+		distance_alt += fabs (angles_alt[k] - Q[k + 3]);
+	}
+
+	if (distance_alt < distance)
+		angles = angles_alt;
+
+	for (unsigned int k = 0; k < 3; k++) {
+		Q[k + 3] = angles[k];
+	}
+
+	return true;
+}
+
+bool LevenbergMarquardtIK (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		rbdlVectorNd &Qres,
+		double step_tol,
+		double lambda,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		) {
+
+	assert (Qinit.size() == model.q_size);
+	assert (body_id.size() == body_point.size());
+	assert (body_id.size() == target_pos.size());
+	assert (body_id.size() == target_valid.size());
+
+	workspace.resize (body_id.size(), model.qdot_size);
+	update_jacobian_structure (model, body_id, workspace);
+	workspace.jacobianError = -1.;
+
+	Qres = Qinit;
+
+	unsigned int ik_iter;
+
+	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
+		update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace);
+
+		// abort if we are getting "close"
+		if (workspace.e.norm() < step_tol) {
+			*steps = ik_iter;
+
+			return true;
+		}
+
+		workspace.damping.setConstant (lambda * lambda);
+		calc_damped_step (workspace, linear_solver, system_form, sparse_jacobian);
+		Qres += workspace.delta_theta;
+
+		if (workspace.delta_theta.norm() < step_tol) {
+			*steps = ik_iter;
+			return true;
+		}
+	}
+
+	*steps = ik_iter;
+
+	return false;
+}
+
+bool SugiharaIK (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		rbdlVectorNd &Qres,
+		double step_tol,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		) {
+
+	assert (Qinit.size() == model.q_size);
+	assert (body_id.size() == body_point.size());
+	assert (body_id.size() == target_pos.size());
+	assert (body_id.size() == target_valid.size());
+
+	workspace.resize (body_id.size(), model.qdot_size);
+	update_jacobian_structure (model, body_id, workspace);
+	workspace.jacobianError = -1.;
+
+	Qres = Qinit;
+
+	unsigned int ik_iter;
+
+	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
+		update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace);
+
+		double wn = 1.0e-3;
+		double Ek = 0.5 * workspace.e.squaredNorm();
+
+		workspace.damping.setConstant (Ek + wn);
+		calc_damped_step (workspace, linear_solver, system_form, sparse_jacobian);
+		Qres += workspace.delta_theta;
+
+		if (workspace.delta_theta.norm() < step_tol) {
+			*steps = ik_iter;
+
+			return true;
+		}
+	}
+
+	*steps = ik_iter;
+
+	return false;
+}
+
+bool SugiharaTaskSpaceIK (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		rbdlVectorNd &Qres,
+		double step_tol,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		) {
+
+	assert (Qinit.size() == model.q_size);
+	assert (body_id.size() == body_point.size());
+	assert (body_id.size() == target_pos.size());
+	assert (body_id.size() == target_valid.size());
+
+	workspace.resize (body_id.size(), model.qdot_size);
+	update_jacobian_structure (model, body_id, workspace);
+	workspace.jacobianError = -1.;
+
+	Qres = Qinit;
+
+	unsigned int ik_iter;
+
+	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
+		update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace);
+
+		// abort if we are getting "close"
+		if (workspace.e.norm() < step_tol) {
+			*steps = ik_iter;
+
+			return true;
+		}
+
+		double wn = 1.0e-3;
+		workspace.damping = workspace.e.array().square() * 0.5 + wn;
+		calc_damped_step (workspace, linear_solver, system_form, sparse_jacobian);
+		Qres += workspace.delta_theta;
+
+		if (workspace.delta_theta.norm() < step_tol) {
+			*steps = ik_iter;
+
+			return true;
+		}
+	}
+
+	*steps = ik_iter;
+
+	return false;
+}
+
+bool AdaptiveLevenbergMarquardtIK (
+		RigidBodyDynamics::Model &model,
+		const rbdlVectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<rbdlVector3d>& body_point,
+		const std::vector<rbdlVector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		rbdlVectorNd &Qres,
+		double step_tol,
+		double gradient_tol,
+		double damping_scale,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		) {
+
+	assert (Qinit.size() == model.q_size);
+	assert (body_id.size() == body_point.size());
+	assert (body_id.size() == target_pos.size());
+	assert (body_id.size() == target_valid.size());
+
+	workspace.resize (body_id.size(), model.qdot_size);
+	update_jacobian_structure (model, body_id, workspace);
+	workspace.jacobianError = -1.;
+
+	Qres = Qinit;
+	update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace);
+
+	// the damping mu of the normal equations (J^T J + mu I) delta = J^T e
+	// starts relative to the largest diagonal element of J^T J
+	double mu = damping_scale * workspace.J.colwise().squaredNorm().maxCoeff();
+	if (mu <= 0.)
+		mu = damping_scale;
+	double nu = 2.;
+	double error = 0.5 * workspace.e.squaredNorm();
+
+	unsigned int ik_iter;
+
+	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
+		workspace.gradient.noalias() = workspace.J.transpose() * workspace.e;
+
+		if (workspace.gradient.lpNorm<Eigen::Infinity>() < gradient_tol
+				|| workspace.e.norm() < step_tol) {
+			*steps = ik_iter;
+			return true;
+		}
+
+		workspace.damping.setConstant (mu);
+		calc_damped_step (workspace, linear_solver, system_form, sparse_jacobian);
+
+		if (workspace.delta_theta.norm() < step_tol) {
+			Qres += workspace.delta_theta;
+			*steps = ik_iter;
+			return true;
+		}
+
+		workspace.q_trial = Qres + workspace.delta_theta;
+		calc_marker_residuals (model, workspace.q_trial, body_id, body_point, target_pos, target_valid, workspace, workspace.e_trial);
+
+		// ratio of the actual and the predicted decrease of the error
+		double error_trial = 0.5 * workspace.e_trial.squaredNorm();
+		double predicted = 0.5 * workspace.delta_theta.dot (mu * workspace.delta_theta + workspace.gradient);
+		double rho = (error - error_trial) / predicted;
+
+		if (predicted > 0. && rho > 0.) {
+			// accept the step, the kinematics are already at the new state
+			Qres = workspace.q_trial;
+			error = error_trial;
+			update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace, false);
+
+			double r = 2. * rho - 1.;
+			mu *= std::max (1. / 3., 1. - r * r * r);
+			nu = 2.;
+		} else {
+			mu *= nu;
+			nu *= 2.;
+
+			// the step may have failed because of the approximation of the
+			// Jacobian
+			if (workspace.jacobianAge > 0) {
+				workspace.jacobianValid = false;
+				update_marker_jacobian_residuals (model, Qres, body_id, body_point, target_pos, target_valid, workspace);
+			}
+		}
+	}
+
+	*steps = ik_iter;
+
+	return false;
+}
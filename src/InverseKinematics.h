@@ -0,0 +1,358 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#ifndef INVERSE_KINEMATICS_H
+#define INVERSE_KINEMATICS_H
+
+#include <vector>
+
+#include <rbdl/rbdl.h>
+
+#include "ModelFitter.h"
+
+struct IKWorkspace;
+
+/** Joint space system of calc_damped_step() with dimensions that are
+ * known at compile time.
+ *
+ * For these sizes Eigen uses fixed size storage and kernels for the
+ * normal equations and their Cholesky decompositions. Instances are
+ * created by create_fixed_joint_system() for the degrees of freedom of
+ * the models that are commonly fitted.
+ */
+struct IKFixedJointSystem {
+	virtual ~IKFixedJointSystem() {}
+
+	/** Computes delta_theta of the workspace. Returns false if the system
+	 * could not be solved with the given decomposition. */
+	virtual bool solve (IKWorkspace &workspace, IKLinearSolver linear_solver, bool sparse_jacobian) = 0;
+};
+
+/** Returns a new fixed size joint space system for the given number of
+ * degrees of freedom or NULL if there is none for this size. */
+IKFixedJointSystem* create_fixed_joint_system (unsigned int dof_count);
+
+/** Storage used by the inverse kinematics methods.
+ *
+ * All matrices and factorizations are allocated once for the given
+ * number of markers and degrees of freedom so that the iterations do not
+ * allocate any memory. Markers without valid targets keep their rows but
+ * contribute zero rows to the Jacobian and residual.
+ */
+struct IKWorkspace {
+	IKWorkspace() :
+		markerCount (0),
+		dofCount (0),
+		allocations (0),
+		batchKinematics (false),
+		useFixedSize (true),
+		jacobianUpdateInterval (1),
+		jacobianAge (0),
+		jacobianValid (false),
+		jacobianError (-1.),
+		exactJacobians (0),
+		broydenUpdates (0),
+		fixedJointSystem (NULL)
+	{}
+	~IKWorkspace() {
+		delete fixedJointSystem;
+	}
+
+	/** Allocates the storage for the given problem size. Does nothing if
+	 * the size has not changed. */
+	void resize (unsigned int marker_count, unsigned int dof_count);
+
+	unsigned int markerCount;
+	unsigned int dofCount;
+	/// number of times the storage had to be (re-)allocated
+	unsigned int allocations;
+	/// whether the Jacobian can be computed from the base coordinate motion
+	/// subspaces (false for models with custom joints)
+	bool batchKinematics;
+	/// whether the fixed size joint space system is used if there is one
+	/// for the number of degrees of freedom
+	bool useFixedSize;
+
+	/// If larger than 1 the exact Jacobian is computed at most at every
+	/// jacobianUpdateInterval-th evaluation (also across calls of the IK)
+	/// and updated with Broyden's method in between. The exact Jacobian is
+	/// also computed if the valid targets change or the error stalls.
+	unsigned int jacobianUpdateInterval;
+	/// number of Broyden updates since the exact Jacobian was computed
+	unsigned int jacobianAge;
+	/// whether J can be updated from q_jacobian and p_jacobian
+	bool jacobianValid;
+	/// squared residual norm at the last evaluation of the current IK call
+	/// (negative at the start of a call)
+	double jacobianError;
+	/// number of exact Jacobians and Broyden updates that were computed
+	unsigned int exactJacobians;
+	unsigned int broydenUpdates;
+	/// state, marker positions (3 * markerCount) and valid targets of the
+	/// last computation or update of J
+	RigidBodyDynamics::Math::VectorNd q_jacobian;
+	RigidBodyDynamics::Math::VectorNd p_jacobian;
+	std::vector<bool> jacobian_targets;
+
+	/// Jacobian of all marker positions (3 * markerCount x dofCount)
+	RigidBodyDynamics::Math::MatrixNd J;
+	/// Jacobian of a single marker position (3 x dofCount)
+	RigidBodyDynamics::Math::MatrixNd G;
+	/// residuals of all markers (3 * markerCount)
+	RigidBodyDynamics::Math::VectorNd e;
+	/// base coordinates of all markers
+	std::vector<RigidBodyDynamics::Math::Vector3d> point_base;
+	/// motion subspaces of all joints in base coordinates (6 x dofCount)
+	RigidBodyDynamics::Math::MatrixNd S_base;
+
+	/// body ids for which the sparsity structure of J was computed
+	std::vector<unsigned int> structure_body_ids;
+	/// The rows of marker k are only nonzero in the columns (in ascending
+	/// order) dof_indices[dof_offsets[k]] to dof_indices[dof_offsets[k + 1] - 1]
+	/// which are the degrees of freedom of the body and its ancestors.
+	std::vector<unsigned int> dof_offsets;
+	std::vector<unsigned int> dof_indices;
+
+	/// damping of each residual (3 * markerCount)
+	RigidBodyDynamics::Math::VectorNd damping;
+	/// Jacobian with rows scaled by the inverse damping
+	RigidBodyDynamics::Math::MatrixNd J_weighted;
+
+	/// damped normal equations in task space (3 * markerCount squared)
+	RigidBodyDynamics::Math::MatrixNd A_task;
+	Eigen::LLT<RigidBodyDynamics::Math::MatrixNd> llt_task;
+	Eigen::LDLT<RigidBodyDynamics::Math::MatrixNd> ldlt_task;
+	Eigen::ColPivHouseholderQR<RigidBodyDynamics::Math::MatrixNd> qr_task;
+	RigidBodyDynamics::Math::VectorNd x_task;
+	RigidBodyDynamics::Math::VectorNd scratch_task;
+
+	/// damped normal equations in joint space (dofCount squared)
+	RigidBodyDynamics::Math::MatrixNd A_joint;
+	Eigen::LLT<RigidBodyDynamics::Math::MatrixNd> llt_joint;
+	Eigen::LDLT<RigidBodyDynamics::Math::MatrixNd> ldlt_joint;
+	Eigen::ColPivHouseholderQR<RigidBodyDynamics::Math::MatrixNd> qr_joint;
+	RigidBodyDynamics::Math::VectorNd rhs_joint;
+	RigidBodyDynamics::Math::VectorNd scratch_joint;
+	/// fixed size variant of the joint space system (NULL if not available)
+	IKFixedJointSystem *fixedJointSystem;
+
+	RigidBodyDynamics::Math::VectorNd delta_theta;
+	/// J^T e, state and residuals of a trial step of the adaptive method
+	RigidBodyDynamics::Math::VectorNd gradient;
+	RigidBodyDynamics::Math::VectorNd q_trial;
+	RigidBodyDynamics::Math::VectorNd e_trial;
+	/// scratch space for the application of Householder reflections
+	RigidBodyDynamics::Math::VectorNd householder;
+
+	private:
+		IKWorkspace (const IKWorkspace &workspace);
+		IKWorkspace& operator= (const IKWorkspace &workspace);
+};
+
+/** Computes the base coordinates of all points body_point of the bodies
+ * body_id using a single kinematics update. */
+void calc_points_base_coordinates (
+		RigidBodyDynamics::Model &model,
+		const RigidBodyDynamics::Math::VectorNd &Q,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		std::vector<RigidBodyDynamics::Math::Vector3d>& point_base,
+		bool update_kinematics = true
+		);
+
+/** Computes the damped least squares step
+ *
+ *   delta_theta = J^T (J J^T + diag(damping))^-1 e
+ *
+ * using the Jacobian, residuals and damping stored in the workspace. In
+ * joint space the equivalent system
+ *
+ *   (J^T W J + I) delta_theta = J^T W e,  W = diag(damping)^-1
+ *
+ * is solved instead, which is smaller if the model has fewer degrees of
+ * freedom than there are marker coordinates. If the Cholesky
+ * decomposition fails the system is solved using QR. For the degrees of
+ * freedom supported by create_fixed_joint_system() the joint space system
+ * is solved with fixed size matrices.
+ *
+ * If sparse_jacobian is true the products with J only use the columns
+ * of each marker that are listed in the sparsity structure of the
+ * workspace.
+ */
+void calc_damped_step (
+		IKWorkspace &workspace,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian
+		);
+
+/// maximum number of markers of the root used by calc_root_pose_initialization()
+#define IK_ROOT_MAX_MARKERS 32
+
+/** Free-flyer joint of the root body as it is created for models such as
+ * HeiMan: three translations along and three rotations about coordinate
+ * axes, which RBDL splits into a chain of single degree of freedom
+ * bodies. */
+struct RootFreeFlyer {
+	RootFreeFlyer() :
+		valid (false),
+		bodyId (0)
+	{}
+
+	/** Checks whether the first six degrees of freedom of the model form
+	 * such a free-flyer. */
+	bool initialize (RigidBodyDynamics::Model &model);
+
+	bool valid;
+	/// body that carries the root markers
+	unsigned int bodyId;
+	/// coordinate axis and direction of each degree of freedom
+	int axes[6];
+	double signs[6];
+	/// translation of the joint frame of the root
+	RigidBodyDynamics::Math::Vector3d offset;
+};
+
+/** Computes the free-flyer degrees of freedom of the root in Q in closed
+ * form from the markers of the root using the Kabsch algorithm. The
+ * remaining values of Q are not modified.
+ *
+ * Returns false if the root is not a free-flyer or fewer than three
+ * non-collinear root markers have valid targets.
+ */
+bool calc_root_pose_initialization (
+		RigidBodyDynamics::Model &model,
+		const RootFreeFlyer &root,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		RigidBodyDynamics::Math::VectorNd &Q
+		);
+
+/** Inverse Kinematics using a Levenberg Marquardt with constant lambda
+ *
+ * All IK methods fit the points body_point of the bodies body_id to the
+ * target positions target_pos of all markers for which target_valid is
+ * true. On return the residuals are stored in workspace.e.
+ *
+ * The positions and Jacobians of all markers are computed in a single
+ * pass over the model. With sparse_jacobian only the columns of the
+ * degrees of freedom that move a marker are used for the step.
+ */
+bool LevenbergMarquardtIK (
+		RigidBodyDynamics::Model &model,
+		const RigidBodyDynamics::Math::VectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		RigidBodyDynamics::Math::VectorNd &Qres,
+		double step_tol,
+		double lambda,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		);
+
+/** Inverse Kinematics method by Sugihara
+ *
+ * Sugihara, T., "Solvability-Unconcerned Inverse Kinematics by the
+ * Levenberg–Marquardt Method," Robotics, IEEE Transactions on , vol.27, no.5,
+ * pp.984,991, Oct. 2011 doi: 10.1109/TRO.2011.2148230
+ */
+bool SugiharaIK (
+		RigidBodyDynamics::Model &model,
+		const RigidBodyDynamics::Math::VectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		RigidBodyDynamics::Math::VectorNd &Qres,
+		double step_tol,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		);
+
+/** Variant of SugiharaIK() that damps each residual separately. */
+bool SugiharaTaskSpaceIK (
+		RigidBodyDynamics::Model &model,
+		const RigidBodyDynamics::Math::VectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		RigidBodyDynamics::Math::VectorNd &Qres,
+		double step_tol,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		);
+
+/** Levenberg Marquardt with adaptive damping
+ *
+ * Steps that do not decrease the error are rejected. The damping is
+ * adapted from the ratio of the actual and the predicted decrease of the
+ * error as described in
+ *
+ * Nielsen, H. B., "Damping Parameter in Marquardt's Method," Technical
+ * Report IMM-REP-1999-05, Technical University of Denmark, 1999.
+ *
+ * The initial damping is damping_scale times the largest diagonal element
+ * of J^T J. Converges if the largest gradient element is below
+ * gradient_tol or the step or residual norm is below step_tol. Rejected
+ * steps count as iterations.
+ */
+bool AdaptiveLevenbergMarquardtIK (
+		RigidBodyDynamics::Model &model,
+		const RigidBodyDynamics::Math::VectorNd &Qinit,
+		const std::vector<unsigned int>& body_id,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& body_point,
+		const std::vector<RigidBodyDynamics::Math::Vector3d>& target_pos,
+		const std::vector<bool>& target_valid,
+		RigidBodyDynamics::Math::VectorNd &Qres,
+		double step_tol,
+		double gradient_tol,
+		double damping_scale,
+		unsigned int max_iter,
+		IKLinearSolver linear_solver,
+		IKSystemForm system_form,
+		bool sparse_jacobian,
+		IKWorkspace &workspace,
+		unsigned int *steps
+		);
+
+/* INVERSE_KINEMATICS_H */
+#endif
@@ -0,0 +1,232 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include "MarkerCache.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cassert>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+std::string get_marker_cache_filename (const char* source_filename) {
+	return std::string (source_filename) + ".mcache";
+}
+
+uint64_t align_marker_cache_offset (uint64_t offset) {
+	return (offset + MARKER_CACHE_ALIGNMENT - 1) / MARKER_CACHE_ALIGNMENT * MARKER_CACHE_ALIGNMENT;
+}
+
+/** Computes a * b and returns false if the product does not fit into 64
+ * bits. */
+bool multiply_marker_cache_size (uint64_t a, uint64_t b, uint64_t *product) {
+	if (b != 0 && a > std::numeric_limits<uint64_t>::max() / b)
+		return false;
+
+	*product = a * b;
+	return true;
+}
+
+/** Whether a section of the given size at offset lies within the file. */
+bool marker_cache_section_fits (uint64_t offset, uint64_t size, uint64_t file_size) {
+	return offset <= file_size && size <= file_size - offset;
+}
+
+bool MarkerCache::open (const char* source_filename) {
+	close();
+
+	struct stat source_stat;
+	if (stat (source_filename, &source_stat) != 0)
+		return false;
+
+	std::string filename = get_marker_cache_filename (source_filename);
+	int fd = ::open (filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat cache_stat;
+	if (fstat (fd, &cache_stat) != 0 || static_cast<size_t>(cache_stat.st_size) < sizeof (MarkerCacheHeader)) {
+		::close (fd);
+		return false;
+	}
+
+	mappedSize = static_cast<size_t>(cache_stat.st_size);
+	void *data = mmap (NULL, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close (fd);
+
+	if (data == MAP_FAILED) {
+		mappedSize = 0;
+		return false;
+	}
+	mappedData = static_cast<const char*>(data);
+	memcpy (&header, mappedData, sizeof (MarkerCacheHeader));
+
+	// the cache is stale if the marker data file has changed
+	bool valid = memcmp (header.magic, MARKER_CACHE_MAGIC, sizeof (header.magic)) == 0
+		&& header.fileSize == mappedSize
+		&& header.sourceSize == static_cast<uint64_t>(source_stat.st_size)
+		&& header.sourceModificationSeconds == static_cast<int64_t>(source_stat.st_mtim.tv_sec)
+		&& header.sourceModificationNanoseconds == static_cast<int64_t>(source_stat.st_mtim.tv_nsec)
+		&& header.lastFrame >= header.firstFrame
+		&& header.validityRowSize == (static_cast<uint64_t>(header.markerCount) + 63) / 64;
+
+	// the sizes are computed without overflows and each offset is checked
+	// before the size of its section is compared to the rest of the file
+	uint64_t frame_count = static_cast<uint64_t>(static_cast<int64_t>(header.lastFrame) - header.firstFrame + 1);
+	uint64_t positions_size = 0;
+	uint64_t validity_size = 0;
+	valid = valid
+		&& multiply_marker_cache_size (frame_count, static_cast<uint64_t>(header.markerCount) * 3 * sizeof (float), &positions_size)
+		&& multiply_marker_cache_size (frame_count, static_cast<uint64_t>(header.validityRowSize) * sizeof (uint64_t), &validity_size)
+		&& header.labelsOffset >= sizeof (MarkerCacheHeader)
+		&& marker_cache_section_fits (header.labelsOffset, header.labelsSize, mappedSize)
+		&& header.positionsOffset % MARKER_CACHE_ALIGNMENT == 0
+		&& header.positionsOffset >= header.labelsOffset + header.labelsSize
+		&& marker_cache_section_fits (header.positionsOffset, positions_size, mappedSize)
+		&& header.validityOffset % MARKER_CACHE_ALIGNMENT == 0
+		&& header.validityOffset >= header.positionsOffset + positions_size
+		&& marker_cache_section_fits (header.validityOffset, validity_size, mappedSize);
+
+	if (valid) {
+		const char *label = mappedData + header.labelsOffset;
+		const char *labels_end = label + header.labelsSize;
+
+		while (label < labels_end && labels.size() < header.markerCount) {
+			const char *label_end = static_cast<const char*>(memchr (label, '\0', labels_end - label));
+			if (!label_end)
+				break;
+
+			labels.push_back (std::string (label, label_end));
+			label = label_end + 1;
+		}
+
+		valid = labels.size() == header.markerCount;
+	}
+
+	if (!valid) {
+		close();
+		return false;
+	}
+
+	positions = reinterpret_cast<const float*>(mappedData + header.positionsOffset);
+	validity = reinterpret_cast<const uint64_t*>(mappedData + header.validityOffset);
+
+	return true;
+}
+
+void MarkerCache::close () {
+	if (mappedData)
+		munmap (const_cast<char*>(mappedData), mappedSize);
+
+	mappedData = NULL;
+	mappedSize = 0;
+	positions = NULL;
+	validity = NULL;
+	memset (&header, 0, sizeof (MarkerCacheHeader));
+	labels.clear();
+}
+
+bool write_marker_cache_section (FILE *file, uint64_t offset, const void *data, size_t size) {
+	long position = ftell (file);
+	if (position < 0 || static_cast<uint64_t>(position) > offset)
+		return false;
+
+	// zero padding up to the aligned start of the section
+	for (uint64_t i = static_cast<uint64_t>(position); i < offset; i++) {
+		if (fputc (0, file) == EOF)
+			return false;
+	}
+
+	return size == 0 || fwrite (data, 1, size, file) == size;
+}
+
+bool MarkerCache::write (const char* source_filename, MarkerCacheHeader header, const std::vector<std::string> &labels, const float *positions, const uint64_t *validity) {
+	assert (labels.size() == header.markerCount);
+
+	struct stat source_stat;
+	if (stat (source_filename, &source_stat) != 0)
+		return false;
+
+	std::string label_data;
+	for (size_t i = 0; i < labels.size(); i++) {
+		label_data.append (labels[i].c_str(), labels[i].size() + 1);
+	}
+
+	uint64_t frame_count = static_cast<uint64_t>(header.lastFrame - header.firstFrame + 1);
+	uint64_t positions_size = frame_count * header.markerCount * 3 * sizeof (float);
+	uint64_t validity_size = frame_count * header.validityRowSize * sizeof (uint64_t);
+
+	memcpy (header.magic, MARKER_CACHE_MAGIC, sizeof (header.magic));
+	header.sourceSize = static_cast<uint64_t>(source_stat.st_size);
+	header.sourceModificationSeconds = static_cast<int64_t>(source_stat.st_mtim.tv_sec);
+	header.sourceModificationNanoseconds = static_cast<int64_t>(source_stat.st_mtim.tv_nsec);
+	header.labelsOffset = align_marker_cache_offset (sizeof (MarkerCacheHeader));
+	header.labelsSize = label_data.size();
+	header.positionsOffset = align_marker_cache_offset (header.labelsOffset + header.labelsSize);
+	header.validityOffset = align_marker_cache_offset (header.positionsOffset + positions_size);
+	header.fileSize = header.validityOffset + validity_size;
+
+	// the cache is written to a temporary file that then replaces the
+	// previous cache
+	std::string filename = get_marker_cache_filename (source_filename);
+	std::vector<char> temp_filename (filename.begin(), filename.end());
+	const char *temp_suffix = ".XXXXXX";
+	temp_filename.insert (temp_filename.end(), temp_suffix, temp_suffix + strlen (temp_suffix) + 1);
+
+	int fd = mkstemp (&temp_filename[0]);
+	if (fd < 0) {
+		cerr << "Warning: could not write marker cache " << filename << endl;
+		return false;
+	}
+	fchmod (fd, 0644);
+
+	FILE *file = fdopen (fd, "wb");
+	bool result = file
+		&& fwrite (&header, sizeof (MarkerCacheHeader), 1, file) == 1
+		&& write_marker_cache_section (file, header.labelsOffset, label_data.data(), label_data.size())
+		&& write_marker_cache_section (file, header.positionsOffset, positions, positions_size)
+		&& write_marker_cache_section (file, header.validityOffset, validity, validity_size);
+
+	if (file) {
+		result = (fclose (file) == 0) && result;
+	} else {
+		::close (fd);
+	}
+
+	if (result)
+		result = rename (&temp_filename[0], filename.c_str()) == 0;
+
+	if (!result) {
+		cerr << "Warning: could not write marker cache " << filename << endl;
+		remove (&temp_filename[0]);
+	}
+
+	return result;
+}
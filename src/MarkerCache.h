@@ -0,0 +1,128 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#ifndef MARKER_CACHE_H
+#define MARKER_CACHE_H
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+/** Sidecar file of the marker cache: a MarkerCacheHeader followed by the
+ * marker labels, the marker positions and the marker validity. Each
+ * section starts at a multiple of MARKER_CACHE_ALIGNMENT bytes so that the
+ * mapped file can be accessed directly. All values are in host byte order.
+ */
+#define MARKER_CACHE_MAGIC "PUPMCAC1"
+
+const uint64_t MARKER_CACHE_ALIGNMENT = 64;
+
+struct MarkerCacheHeader {
+	char magic[8];
+	/// size and modification time of the marker data file the cache was
+	/// created from
+	uint64_t sourceSize;
+	int64_t sourceModificationSeconds;
+	int64_t sourceModificationNanoseconds;
+	/// hash of the contents of the marker data file (see hash_file())
+	uint64_t sourceHash;
+	int32_t firstFrame;
+	int32_t lastFrame;
+	float frameRate;
+	uint32_t markerCount;
+	/// number of 64 bit words of the validity of a frame
+	uint32_t validityRowSize;
+	/// see MarkerData::getBackwardsFrameFraction()
+	float backwardsFrameFraction;
+	/// labels of all markers as consecutive '\0' terminated strings
+	uint64_t labelsOffset;
+	uint64_t labelsSize;
+	/// positions in meters in frames x markers x 3 layout (float32)
+	uint64_t positionsOffset;
+	/// validity bits of all frames, layout as MarkerData::markerValidity
+	uint64_t validityOffset;
+	uint64_t fileSize;
+};
+
+/** Returns the name of the marker cache of the given marker data file. */
+std::string get_marker_cache_filename (const char* source_filename);
+
+/** Marker cache file that is mapped into memory.
+ *
+ * The cache contains the decoded marker data of a C3D file, i.e. the
+ * positions scaled to meters and their validity, and statistics that
+ * would otherwise require a pass over all frames. It is written next to
+ * the C3D file and is only used as long as size and modification time of
+ * the C3D file match the ones stored in the cache.
+ */
+struct MarkerCache {
+	MarkerCache() :
+		mappedData (NULL),
+		mappedSize (0),
+		positions (NULL),
+		validity (NULL)
+	{
+		memset (&header, 0, sizeof (MarkerCacheHeader));
+	}
+	~MarkerCache() {
+		close();
+	}
+
+	/** Maps the cache of the given marker data file. Returns false if there
+	 * is no cache or it does not belong to the current file contents. */
+	bool open (const char* source_filename);
+	void close ();
+
+	/** Writes the cache of the given marker data file. The values of the
+	 * header that describe the data have to be set, the source file
+	 * information and the section offsets are filled in. The file is
+	 * replaced atomically so that concurrent readers never see a partially
+	 * written cache. */
+	static bool write (const char* source_filename, MarkerCacheHeader header, const std::vector<std::string> &labels, const float *positions, const uint64_t *validity);
+
+	int getFrameCount () const {
+		return header.lastFrame - header.firstFrame + 1;
+	}
+	const float* getPosition (int marker_index, int frame_index) const {
+		return positions + 3 * (static_cast<size_t>(frame_index) * header.markerCount + marker_index);
+	}
+
+	MarkerCacheHeader header;
+	/// label of each marker (empty for markers without label)
+	std::vector<std::string> labels;
+
+	const char *mappedData;
+	size_t mappedSize;
+	const float *positions;
+	const uint64_t *validity;
+
+	private:
+		MarkerCache (const MarkerCache &cache);
+		MarkerCache& operator= (const MarkerCache &cache);
+};
+
+/* MARKER_CACHE_H */
+#endif
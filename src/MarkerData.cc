@@ -26,8 +26,11 @@
 #include "Scene.h"
 #include "MarkerData.h"
 #include "c3dfile.h"
+#include "FitCache.h"
+#include "MarkerCache.h"
 
 #include <limits>
+#include <algorithm>
 
 using namespace std;
 
@@ -36,37 +39,190 @@ MarkerData::~MarkerData() {
 		delete c3dfile;
 		c3dfile = NULL;
 	}
+	if (markerCache) {
+		delete markerCache;
+		markerCache = NULL;
+	}
 	for (size_t i = 0; i < markers.size(); i++) {
 		scene->destroyObject<MarkerObject>(markers[i]);
 	}
 }
 
 bool MarkerData::loadFromFile(const char *filename) {
+	if (!useMarkerCache || !loadFromMarkerCache (filename)) {
+		if (!openFile (filename))
+			return false;
+
+		setFrameWindow (getFirstFrame(), getLastFrame());
+
+		if (useMarkerCache)
+			writeMarkerCache();
+	}
+
+	if (!scene)
+		return true;
+
+	for (size_t i = 0; i < markerNames.size(); i++) {
+	  std::string tmp = markerNames.at(i);
+	  enableMarker(tmp.c_str(), Vector3f(0.f, 0.f, 1.f));
+	}
+
+	return true;
+}
+
+bool MarkerData::openFile(const char *filename) {
 	if (c3dfile) {
 		delete c3dfile;
 		markers.clear();
 	}
+	if (markerCache) {
+		delete markerCache;
+		markerCache = NULL;
+	}
 
 	c3dfile = new C3DFile;
-	if (!c3dfile->load (filename)) {
+	if (!c3dfile->open (filename)) {
 		cerr << "Error loading marker data from file '" << filename << "'!" << endl;
-		abort();
+		delete c3dfile;
+		c3dfile = NULL;
 		return false;
 	}
 
+	fileName = filename;
+	fileHash = 0;
 	currentFrame = getFirstFrame();
+	markerValidity.clear();
+	backwardsFrameFraction = -2.f;
+	buildMarkerIdTable();
 
-	if (!scene)
-		return true;
+	return true;
+}
 
-	for (size_t i = 0; i < markerNames.size(); i++) {
-	  std::string tmp = markerNames.at(i);
-	  enableMarker(tmp.c_str(), Vector3f(0.f, 0.f, 1.f));
+bool MarkerData::loadFromMarkerCache (const char *filename) {
+	MarkerCache *cache = new MarkerCache;
+	if (!cache->open (filename)) {
+		delete cache;
+		return false;
+	}
+
+	if (c3dfile) {
+		delete c3dfile;
+		c3dfile = NULL;
+		markers.clear();
 	}
+	if (markerCache)
+		delete markerCache;
+	markerCache = cache;
+
+	fileName = filename;
+	fileHash = markerCache->header.sourceHash;
+	currentFrame = getFirstFrame();
+	backwardsFrameFraction = markerCache->header.backwardsFrameFraction;
+	buildMarkerIdTable();
+
+	int frame_count = markerCache->getFrameCount();
+	validityFirstFrame = getFirstFrame();
+	validityRowSize = markerCache->header.validityRowSize;
+	markerValidity.assign (markerCache->validity, markerCache->validity + validityRowSize * frame_count);
 
 	return true;
 }
 
+void MarkerData::writeMarkerCache () {
+	assert (c3dfile);
+	assert (getWindowFirstFrame() == getFirstFrame() && getWindowLastFrame() == getLastFrame());
+
+	MarkerCacheHeader header;
+	memset (&header, 0, sizeof (MarkerCacheHeader));
+	header.sourceHash = getFileHash();
+	header.firstFrame = getFirstFrame();
+	header.lastFrame = getLastFrame();
+	header.frameRate = getFrameRate();
+	header.markerCount = static_cast<uint32_t>(c3dfile->getPointCount());
+	header.validityRowSize = validityRowSize;
+	header.backwardsFrameFraction = getBackwardsFrameFraction();
+
+	// positions are stored in meters and without rotation, the same
+	// scaling as in getMarkerPosition() yields identical values
+	size_t frame_count = c3dfile->getFrameCount();
+	size_t value_count = frame_count * header.markerCount * 3;
+	std::vector<float> positions (value_count);
+	for (size_t fi = 0; fi < frame_count; fi++) {
+		const float *frame_positions = c3dfile->getFramePositions (fi);
+		for (size_t i = 0; i < header.markerCount * 3; i++) {
+			positions[fi * header.markerCount * 3 + i] = frame_positions[i] * static_cast<float>(1.0e-3);
+		}
+	}
+
+	MarkerCache::write (fileName.c_str(), header, markerLabels, positions.data(), markerValidity.data());
+}
+
+void MarkerData::buildMarkerIdTable () {
+	assert (c3dfile || markerCache);
+
+	markerIds.clear();
+
+	if (markerCache) {
+		markerLabels = markerCache->labels;
+	} else {
+		// only the labels that can be resolved to a stored point are used
+		markerLabels.assign (c3dfile->getPointCount(), "");
+		for (std::map<std::string, Sint16>::const_iterator label_iter = c3dfile->label_point_map.begin(); label_iter != c3dfile->label_point_map.end(); label_iter++) {
+			if (label_iter->second >= 0 && label_iter->second < static_cast<Sint16>(markerLabels.size()))
+				markerLabels[label_iter->second] = label_iter->first;
+		}
+	}
+
+	for (size_t i = 0; i < markerLabels.size(); i++) {
+		if (markerLabels[i] != "")
+			markerIds[markerLabels[i]] = static_cast<int>(i);
+	}
+}
+
+void MarkerData::setFrameWindow (int frame_start, int frame_end) {
+	assert (c3dfile || markerCache);
+	assert (frame_start >= getFirstFrame() && frame_start <= frame_end && frame_end <= getLastFrame());
+
+	if (markerCache) {
+		currentFrame = std::max (frame_start, std::min (currentFrame, frame_end));
+		return;
+	}
+
+	c3dfile->setFrameWindow (frame_start - getFirstFrame(), frame_end - frame_start + 1);
+
+	// the trajectories are accessed from multiple fitting threads and
+	// therefore all markers are decoded in a single pass up front
+	c3dfile->decodeAllMarkers();
+	computeMarkerValidity();
+
+	currentFrame = std::max (frame_start, std::min (currentFrame, frame_end));
+}
+
+int MarkerData::getWindowFirstFrame () {
+	assert (c3dfile || markerCache);
+
+	if (markerCache)
+		return getFirstFrame();
+
+	return getFirstFrame() + static_cast<int>(c3dfile->window_first);
+}
+
+int MarkerData::getWindowLastFrame () {
+	assert (c3dfile || markerCache);
+
+	if (markerCache)
+		return getLastFrame();
+
+	return getWindowFirstFrame() + static_cast<int>(c3dfile->window_frame_count) - 1;
+}
+
+uint64_t MarkerData::getFileHash () {
+	if (fileHash == 0)
+		fileHash = hash_file (fileName.c_str());
+
+	return fileHash;
+}
+
 void MarkerData::clearMarkers () {
 	for (unsigned int i = 0; i < markers.size(); i++) {
 		scene->destroyObject<MarkerObject>(markers[i]);
@@ -76,46 +232,178 @@ void MarkerData::clearMarkers () {
 }
 
 void MarkerData::enableMarker (const char* marker_name, const Vector3f &color) {
-	assert (c3dfile);
-
-	if (markerExists(marker_name)) {
-		MarkerObject* scene_marker = scene->createObject<MarkerObject>();
-		scene_marker->color.block<3,1>(0,0) = color;
-
-		Vector3f position = getMarkerCurrentPosition(marker_name);
-		scene_marker->transformation.translation = position;
-		scene_marker->mesh = CreateUVSphere (4, 8);
-		scene_marker->transformation.scaling = Vector3f (0.02f, 0.02f, 0.02f);
-		scene_marker->noDepthTest = true;
-		scene_marker->markerName = marker_name;
+	int marker_index = getMarkerIndex (marker_name);
 
-		markers.push_back (scene_marker);
+	if (marker_index >= 0) {
+		enableMarker (marker_index, color);
 	} else {
 		std::cout << "Warning: marker " << marker_name << " does not exist" << std::endl;
 	}
 }
 
+void MarkerData::enableMarker (int marker_index, const Vector3f &color) {
+	assert (c3dfile || markerCache);
+	assert (marker_index >= 0 && marker_index < getMarkerCount());
+
+	MarkerObject* scene_marker = scene->createObject<MarkerObject>();
+	scene_marker->color.block<3,1>(0,0) = color;
+
+	Vector3f position = getMarkerPosition (marker_index, currentFrame);
+	scene_marker->transformation.translation = position;
+	scene_marker->mesh = CreateUVSphere (4, 8);
+	scene_marker->transformation.scaling = Vector3f (0.02f, 0.02f, 0.02f);
+	scene_marker->noDepthTest = true;
+	scene_marker->markerName = markerLabels[marker_index];
+	scene_marker->markerIndex = marker_index;
+
+	markers.push_back (scene_marker);
+}
+
 bool MarkerData::markerExists(const char* marker_name) {
-	std::string point_label(marker_name);
-	
-	point_label = point_label.substr(0, point_label.find_last_not_of(" ") + 1);
+	return getMarkerIndex (marker_name) >= 0;
+}
 
-	if (c3dfile->label_point_map.find(point_label) == c3dfile->label_point_map.end()) {
-		return false;
-	}
+/** Returns the id of the marker that can be used for getMarkerPosition()
+ * and all other functions that take a marker_index or -1 if the marker
+ * does not exist. Trailing spaces of the name are ignored.
+ *
+ * Resolving the name is comparatively expensive and should therefore be
+ * done once and not for every frame.
+ */
+int MarkerData::getMarkerIndex(const char* marker_name) {
+	size_t length = strlen (marker_name);
+	while (length > 0 && marker_name[length - 1] == ' ')
+		length--;
 
-	return true;
+	std::map<std::string, int>::const_iterator id_iter = markerIds.find (std::string (marker_name, length));
+	if (id_iter == markerIds.end())
+		return -1;
+
+	return id_iter->second;
 }
 
 Vector3f MarkerData::getMarkerCurrentPosition(const char * marker_name) {
-	FloatMarkerData marker_traj = c3dfile->getMarkerTrajectories (marker_name);
+	int marker_index = getMarkerIndex (marker_name);
 
-	int index = currentFrame - getFirstFrame();
+	if (marker_index < 0) {
+		cerr << "Error: could not find marker with name '" << marker_name << "'!" << endl;
+		abort();
+	}
+
+	return getMarkerCurrentPosition (marker_index);
+}
+
+Vector3f MarkerData::getMarkerCurrentPosition(int marker_index) const {
+	return getMarkerPosition (marker_index, currentFrame);
+}
+
+/** Returns the position of a marker at the given frame.
+ *
+ * Does neither allocate memory nor modify currentFrame or the scene and can
+ * therefore also be used from fitting threads.
+ */
+Vector3f MarkerData::getMarkerPosition(int marker_index, int frame_number) const {
+	if (markerCache) {
+		assert (frame_number >= markerCache->header.firstFrame && frame_number <= markerCache->header.lastFrame);
+
+		// positions of the cache are already stored in meters
+		const float *position = markerCache->getPosition (marker_index, frame_number - markerCache->header.firstFrame);
+
+		if (rotateZ)
+			return Vector3f (-position[0], -position[1], position[2]);
+
+		return Vector3f (position[0], position[1], position[2]);
+	}
+
+	assert (c3dfile);
+	assert (frame_number >= static_cast<int>(c3dfile->header.first_frame));
+	assert (frame_number <= static_cast<int>(c3dfile->header.last_frame));
+
+	int index = frame_number - static_cast<int>(c3dfile->header.first_frame);
+
+	const float *position = c3dfile->getPointPosition (marker_index, index);
 
 	if (rotateZ) 
-		return Vector3f (-marker_traj.x[index], -marker_traj.y[index], marker_traj.z[index]) * 1.0e-3;
+		return Vector3f (-position[0], -position[1], position[2]) * 1.0e-3;
 	
-	return Vector3f (marker_traj.x[index], marker_traj.y[index], marker_traj.z[index]) * 1.0e-3;
+	return Vector3f (position[0], position[1], position[2]) * 1.0e-3;
+}
+
+void MarkerData::computeMarkerValidity () {
+	assert (c3dfile);
+
+	int frame_count = getWindowLastFrame() - getWindowFirstFrame() + 1;
+	size_t marker_count = c3dfile->getPointCount();
+
+	validityFirstFrame = getWindowFirstFrame();
+	validityRowSize = static_cast<unsigned int>((marker_count + 63) / 64);
+	markerValidity.assign (validityRowSize * frame_count, 0);
+
+	size_t window_first = c3dfile->window_first;
+
+	for (int fi = 0; fi < frame_count; fi++) {
+		const float *frame_positions = c3dfile->getFramePositions (window_first + fi);
+
+		for (size_t mi = 0; mi < marker_count; mi++) {
+			// positions are stored in millimeters
+			const float *position = frame_positions + 3 * mi;
+			float squared_norm = position[0] * position[0]
+				+ position[1] * position[1]
+				+ position[2] * position[2];
+
+			bool valid = c3dfile->isPointValid (static_cast<int>(mi), window_first + fi)
+				&& squared_norm > 0.f
+				&& squared_norm <= 1.0e8f;
+
+			if (valid)
+				markerValidity[validityRowSize * fi + mi / 64] |= static_cast<uint64_t>(1) << (mi % 64);
+		}
+	}
+}
+
+int MarkerData::getMissingFrameCount (int marker_index, int frame_first, int frame_last) const {
+	int missing_count = 0;
+
+	for (int frame = frame_first; frame <= frame_last; frame++) {
+		if (!isMarkerValid (marker_index, frame))
+			missing_count++;
+	}
+
+	return missing_count;
+}
+
+float MarkerData::getBackwardsFrameFraction () {
+	if (backwardsFrameFraction >= -1.f)
+		return backwardsFrameFraction;
+
+	int lasi_index = getMarkerIndex ("LASI");
+	int lpsi_index = getMarkerIndex ("LPSI");
+
+	if (lasi_index < 0 || lpsi_index < 0) {
+		backwardsFrameFraction = -1.f;
+		return backwardsFrameFraction;
+	}
+
+	float fraction_negative = 0.f;
+	int frame_count = getLastFrame() - getFirstFrame();
+
+	for (int i = getFirstFrame(); i < getLastFrame(); i++) {
+		Vector3f lasi = getMarkerPosition (lasi_index, i);
+		Vector3f lpsi = getMarkerPosition (lpsi_index, i);
+
+		float projection = (lasi - lpsi).normalize().dot(Vector3f (1.f, 0.f, 0.f));
+
+		// the rotation about Z flips the sign of the projection
+		if (rotateZ)
+			projection = -projection;
+
+		if (projection < -0.)
+			fraction_negative = fraction_negative + 1.f / static_cast<float>(frame_count);
+	}
+
+	backwardsFrameFraction = fraction_negative;
+
+	return backwardsFrameFraction;
 }
 
 std::string MarkerData::getMarkerName (int object_id) {
@@ -131,19 +419,28 @@ std::string MarkerData::getMarkerName (int object_id) {
 }
 
 int MarkerData::getFirstFrame () {
-	assert (c3dfile);
+	assert (c3dfile || markerCache);
+
+	if (markerCache)
+		return markerCache->header.firstFrame;
 
 	return static_cast<int>(c3dfile->header.first_frame);
 }
 
 int MarkerData::getLastFrame () {
-	assert (c3dfile);
+	assert (c3dfile || markerCache);
+
+	if (markerCache)
+		return markerCache->header.lastFrame;
 
 	return static_cast<int>(c3dfile->header.last_frame);
 }
 
 float MarkerData::getFrameRate () {
-	assert (c3dfile);
+	assert (c3dfile || markerCache);
+
+	if (markerCache)
+		return markerCache->header.frameRate;
 
 	return c3dfile->header.video_sampling_rate;
 }
@@ -159,7 +456,7 @@ void MarkerData::setCurrentFrameNumber (int frame_number) {
 
 void MarkerData::updateMarkerSceneObjects() {
 	for (size_t i = 0; i < markers.size(); i++) {
-		Vector3f position = getMarkerCurrentPosition(markers[i]->markerName.c_str());
+		Vector3f position = getMarkerPosition (markers[i]->markerIndex, currentFrame);
 		markers[i]->transformation.translation = position;
 	}
 }
@@ -168,13 +465,9 @@ void MarkerData::calcDataBoundingBox(Vector3f &min, Vector3f &max) {
 	min = Vector3f (std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
 	max = -min;
 
-	int current_frame_temp = currentFrame;
-
 	for (int frame = getFirstFrame(); frame <= getLastFrame(); frame++) {
-		setCurrentFrameNumber (frame);
-		
 		for (size_t mi = 0; mi < markers.size(); mi++) {
-			Vector3f pos = getMarkerCurrentPosition (markers[mi]->markerName.c_str());
+			Vector3f pos = getMarkerPosition (markers[mi]->markerIndex, frame);
 
 			for (size_t i = 0; i < 2; i++) {
 				min[i] = std::min(pos[i], min[i]);
@@ -182,6 +475,4 @@ void MarkerData::calcDataBoundingBox(Vector3f &min, Vector3f &max) {
 			}
 		}
 	}
-
-	setCurrentFrameNumber(current_frame_temp);
 }
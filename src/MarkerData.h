@@ -28,37 +28,78 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <stdint.h>
 
 #include "SimpleMath/SimpleMath.h"
 #include "SimpleMath/SimpleMathGL.h"
 
 struct C3DFile;
+struct MarkerCache;
 struct Scene;
 
 struct MarkerObject : public SceneObject {
 	std::string markerName;
+	int markerIndex;
 };
 
 struct MarkerData {
 	MarkerData() :
 		scene (NULL),
 		c3dfile (NULL),
+		markerCache (NULL),
 		currentFrame (-1),
-		rotateZ(false)
+		rotateZ(false),
+		useMarkerCache (false),
+		fileHash (0),
+		validityFirstFrame (0),
+		validityRowSize (0),
+		backwardsFrameFraction (-2.f)
 	{}
 	MarkerData(Scene* scene_) :
 		scene (scene_),
 		c3dfile (NULL),
+		markerCache (NULL),
 		currentFrame (-1),
-		rotateZ(false)
+		rotateZ(false),
+		useMarkerCache (false),
+		fileHash (0),
+		validityFirstFrame (0),
+		validityRowSize (0),
+		backwardsFrameFraction (-2.f)
 	{}
 	~MarkerData();
 
 	Scene *scene;
 	C3DFile *c3dfile;
+	/// decoded data of the file if it was loaded from its marker cache
+	MarkerCache *markerCache;
 	int currentFrame;
 	std::vector<MarkerObject*> markers;
 	bool rotateZ;
+	/// whether loadFromFile() reads and writes the marker cache next to
+	/// the file (see MarkerCache)
+	bool useMarkerCache;
+	/// file the data was loaded from
+	std::string fileName;
+	/// hash of the contents of the file (0 until computed by getFileHash())
+	uint64_t fileHash;
+
+	/// Validity of all markers at all frames of the frame window that is
+	/// computed when the window is set. The bits of a frame are stored in
+	/// validityRowSize consecutive words, bit (marker_index % 64) of word
+	/// (marker_index / 64) belongs to the marker with the given index.
+	std::vector<uint64_t> markerValidity;
+	int validityFirstFrame;
+	unsigned int validityRowSize;
+
+	/// Labels of the markers of the loaded file (without trailing spaces).
+	/// The index of a label is the id of the marker that is used by all
+	/// functions that take a marker_index. Markers without a label have an
+	/// empty label.
+	std::vector<std::string> markerLabels;
+	/// id of each non-empty label of markerLabels
+	std::map<std::string, int> markerIds;
 
 	bool isMarkerObject(int objectid) {
 		for (size_t i = 0; i < markers.size(); i++) {
@@ -71,18 +112,75 @@ struct MarkerData {
 	std::vector<std::string> markerNames;
 	void clearMarkers ();
 	void enableMarker (const char* marker_name, const Vector3f &color);
+	void enableMarker (int marker_index, const Vector3f &color);
+	/** Loads the file and decodes all frames. If useMarkerCache is set the
+	 * data is read from the marker cache of the file and the cache is
+	 * written if it does not exist or is out of date. */
 	bool loadFromFile (const char* filename);
+	/** Opens the file without decoding any frames. Before the marker
+	 * positions can be queried a frame window has to be set with
+	 * setFrameWindow(). Returns false if the file cannot be read. */
+	bool openFile (const char* filename);
+	/** Decodes the frames frame_start to frame_end (inclusive) and
+	 * computes their validity. Positions and validity of all other frames
+	 * must not be queried until the next call. Scene markers are not
+	 * enabled for files that were opened with openFile(). Data that was
+	 * loaded from the marker cache always contains all frames.
+	 */
+	void setFrameWindow (int frame_start, int frame_end);
+	/** Returns the hash of the contents of the loaded file which is
+	 * computed at the first call. */
+	uint64_t getFileHash ();
 	bool markerExists (const char* marker_name);
+	int getMarkerIndex (const char* marker_name);
+	int getMarkerCount () const {
+		return static_cast<int>(markerLabels.size());
+	}
+	const std::string& getMarkerLabel (int marker_index) const {
+		return markerLabels[marker_index];
+	}
 	Vector3f getMarkerCurrentPosition (const char* marker_name);
+	Vector3f getMarkerCurrentPosition (int marker_index) const;
+	Vector3f getMarkerPosition (int marker_index, int frame_number) const;
+	/** Returns whether the marker has valid data at the given frame.
+	 *
+	 * A marker is invalid if the C3D file flags it as invalid, its position
+	 * is zero or it is further than 10m away from the origin.
+	 */
+	bool isMarkerValid (int marker_index, int frame_number) const {
+		const uint64_t *row = &markerValidity[validityRowSize * (frame_number - validityFirstFrame)];
+		return (row[marker_index / 64] >> (marker_index % 64)) & 1;
+	}
+	/** Returns the number of frames in [frame_first, frame_last] at which
+	 * the marker has no valid data. */
+	int getMissingFrameCount (int marker_index, int frame_first, int frame_last) const;
+	/** Returns the fraction of the frames at which the subject faces along
+	 * the negative X axis (ignoring rotateZ) as indicated by the markers
+	 * LASI and LPSI or -1 if there are no such markers. The value is
+	 * computed at the first call, which requires all frames to be in the
+	 * frame window, or read from the marker cache. */
+	float getBackwardsFrameFraction ();
 	std::string getMarkerName (int objectid);
 	int getFirstFrame ();
 	int getLastFrame ();
+	/** Returns the first frame of the frame window. */
+	int getWindowFirstFrame ();
+	/** Returns the last frame of the frame window. */
+	int getWindowLastFrame ();
 	float getFrameRate ();
 	void setCurrentFrameNumber (int frame_number);
 	void updateMarkerSceneObjects();
 	void calcDataBoundingBox (Vector3f &min, Vector3f &max);
 
 	private:
+	/// see getBackwardsFrameFraction() (-2 until computed)
+	float backwardsFrameFraction;
+
+	bool loadFromMarkerCache (const char* filename);
+	void buildMarkerIdTable ();
+	void writeMarkerCache ();
+	void computeMarkerValidity ();
+
 	MarkerData (const MarkerData &marker_data) {};
 	MarkerData& operator= (const MarkerData &marker_data) { return *this; };
 };
@@ -303,7 +303,8 @@ Vector3f Model::getMarkerPosition (int frame_id, const char* marker_name) {
 
 void Model::setFrameMarkerCoord (int frame_id, const char* marker_name, const Vector3f &coord) {
 	(*luaTable)["frames"][frame_id]["markers"][marker_name] = coord;
-	updateFromLua();
+	updateFromLua(false);
+	markerRevisions[marker_name] = revision;
 }
 
 void Model::updateSceneObjects() {
@@ -335,11 +336,8 @@ void Model::updateSceneObjects() {
 	}
 
 	for (size_t i = 0; i < modelMarkers.size(); i++) {
-		int frame_id = modelMarkers[i]->frameId;
-		std::string marker_name = modelMarkers[i]->markerName;
-		int rbdl_id = frameIdToRbdlId[frame_id];
-
-		Vector3f local_coords = (*luaTable)["frames"][frame_id]["markers"][marker_name.c_str()].getDefault<Vector3f>(Vector3f (0.f, 0.f, 0.f));
+		int rbdl_id = frameIdToRbdlId[modelMarkers[i]->frameId];
+		const Vector3f &local_coords = modelMarkers[i]->localCoords;
 
 		RBDLVector3d rbdl_vec3 = CalcBodyToBaseCoordinates (*rbdlModel, q, rbdl_id, RigidBodyDynamics::Math::Vector3d (local_coords[0], local_coords[1], local_coords[2]), false);
 
@@ -488,7 +486,7 @@ Vector3f Model::getJointOrientationLocalEulerYXZ (int frame_id) {
 void Model::setVisualDimensions (int frame_id, int visuals_index, const Vector3f &dimensions) {
 	(*luaTable)["frames"][frame_id]["visuals"][visuals_index]["dimensions"] = dimensions;
 
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getVisualDimensions (int frame_id, int visuals_index) {
@@ -497,7 +495,7 @@ Vector3f Model::getVisualDimensions (int frame_id, int visuals_index) {
 
 void Model::setVisualScale (int frame_id, int visuals_index, const Vector3f &scale) {
 	(*luaTable)["frames"][frame_id]["visuals"][visuals_index]["scale"] = scale;
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getVisualScale (int frame_id, int visuals_index) {
@@ -506,7 +504,7 @@ Vector3f Model::getVisualScale (int frame_id, int visuals_index) {
 
 void Model::setVisualCenter (int frame_id, int visuals_index, const Vector3f &center) {
 	(*luaTable)["frames"][frame_id]["visuals"][visuals_index]["mesh_center"] = center;
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getVisualCenter(int frame_id, int visuals_index) {
@@ -515,7 +513,7 @@ Vector3f Model::getVisualCenter(int frame_id, int visuals_index) {
 
 void Model::setVisualTranslate (int frame_id, int visuals_index, const Vector3f &translate) {
 	(*luaTable)["frames"][frame_id]["visuals"][visuals_index]["mesh_translate"] = translate;
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getVisualTranslate(int frame_id, int visuals_index) {
@@ -524,7 +522,7 @@ Vector3f Model::getVisualTranslate(int frame_id, int visuals_index) {
 
 void Model::setVisualColor (int frame_id, int visuals_index, const Vector3f &color) {
 	(*luaTable)["frames"][frame_id]["visuals"][visuals_index]["color"] = color;
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getVisualColor(int frame_id, int visuals_index) {
@@ -608,12 +606,12 @@ void Model::setContactPointGlobal (int contact_point_index, const Vector3f &glob
 
 	(*luaTable)["points"][contact_point_index]["point"] = Vector3f (point_local[0], point_local[1], point_local[2]);
 
-	updateFromLua();
+	updateFromLua(false);
 }
 
 void Model::setContactPointLocal (int contact_point_index, const Vector3f &local_coords) {
 	(*luaTable)["points"][contact_point_index]["point"] = local_coords;
-	updateFromLua();
+	updateFromLua(false);
 }
 
 Vector3f Model::getContactPointLocal (int contact_point_index) const {
@@ -635,8 +633,24 @@ void Model::clearModel() {
 	frameIdToRbdlId.clear();
 }
 
-void Model::updateFromLua() {
+bool Model::getEditedMarkers (unsigned int since_revision, std::vector<std::string> *marker_names) const {
+	if (kinematicsRevision > since_revision)
+		return false;
+
+	marker_names->clear();
+	for (std::map<std::string, unsigned int>::const_iterator iter = markerRevisions.begin(); iter != markerRevisions.end(); iter++) {
+		if (iter->second > since_revision)
+			marker_names->push_back (iter->first);
+	}
+
+	return true;
+}
+
+void Model::updateFromLua(bool kinematics_changed) {
 	clearModel();
+	revision++;
+	if (kinematics_changed)
+		kinematicsRevision = revision;
 
 //	assert (luaTable->L);
 
@@ -806,6 +820,7 @@ void Model::updateFromLua() {
 
 				string marker_name = marker_keys[mi].string_value;
 				ModelMarkerObject* marker_scene_object = getModelMarkerObject (i, marker_name.c_str());
+				marker_scene_object->localCoords = (*luaTable)["frames"][i]["markers"][marker_name.c_str()].getDefault<Vector3f>(Vector3f (0.f, 0.f, 0.f));
 				marker_scene_object->mesh = CreateUVSphere (8, 16);
 				marker_scene_object->transformation.scaling = Vector3f (0.02f, 0.02f, 0.02f);
 				marker_scene_object->noDepthTest = true;
@@ -91,6 +91,8 @@ struct VisualsObject: public SceneObject {
 struct ModelMarkerObject: public SceneObject {
 	std::string markerName;
 	int frameId;
+	/// coordinates of the marker in the frame, updated by updateFromLua()
+	Vector3f localCoords;
 };
 
 /**
@@ -103,13 +105,17 @@ struct Model {
 		fileName(""),
 		scene(NULL),
 		luaTable(NULL),
-		rbdlModel(NULL)
+		rbdlModel(NULL),
+		revision(0),
+		kinematicsRevision(0)
 	{}
 	Model(Scene* scene_) :
 		fileName(""),
 		scene (scene_),
 		luaTable (NULL),
-		rbdlModel (NULL)
+		rbdlModel (NULL),
+		revision (0),
+		kinematicsRevision (0)
 	{}
 	~Model();
 
@@ -118,6 +124,14 @@ struct Model {
 	LuaTable *luaTable;
 	RigidBodyDynamics::Model *rbdlModel;
 	VectorNd modelStateQ;
+	/// incremented whenever the model is rebuilt from the LuaTable (e.g.
+	/// when markers were edited)
+	unsigned int revision;
+	/// last revision at which a change affected the marker positions of
+	/// all poses (e.g. joint locations)
+	unsigned int kinematicsRevision;
+	/// revision at which the coordinates of a marker were last changed
+	std::map<std::string, unsigned int> markerRevisions;
 
 	std::vector<JointObject*> joints;
 	std::vector<VisualsObject*> visuals;
@@ -180,6 +194,14 @@ struct Model {
 	void setModelStateValue (unsigned int state_index, double value);
 	bool stateIndexIsFrameJointVariable (unsigned int state_index, int frame_id);
 
+	/** Collects the names of the markers whose coordinates were changed
+	 * after the given revision.
+	 *
+	 * Returns false if a change after the given revision affected all
+	 * markers, in which case marker_names is not filled.
+	 */
+	bool getEditedMarkers (unsigned int since_revision, std::vector<std::string> *marker_names) const;
+
 	JointObject* getJointObject (int frame_id);
 	VisualsObject* getVisualsObject (int frame_id, int visual_index);
 	ModelMarkerObject* getModelMarkerObject (int frame_id, const char* marker_name);
@@ -242,7 +264,10 @@ struct Model {
 	void loadStateFromFile (const char* filename);
 	void saveStateToFile (const char* filename);
 	void clearModel();
-	void updateFromLua ();
+	/** Rebuilds the RBDL model from the LuaTable. Callers that only changed
+	 * the visuals, markers or contact points pass false so that fitted
+	 * animations can be kept (see getEditedMarkers()). */
+	void updateFromLua (bool kinematics_changed = true);
 	void updateSceneObjects();
 
 	private:
@@ -28,8 +28,18 @@
 #include "Model.h"
 #include "MarkerData.h"
 #include "Animation.h"
+#include "InverseKinematics.h"
+#include "FitCache.h"
+#include <thread>
+#include <sstream>
 #include <fstream>
+#include <iomanip>
+#include <atomic>
+#include <algorithm>
 #include <rbdl/rbdl.h>
+#include "luatables.h"
+
+#include "vtkChart/simpleInterpolation/SplineInterpolator.h"
 
 using namespace std;
 
@@ -47,18 +57,96 @@ OutType ConvertVector(const InType &in_vec) {
 	return result;
 }
 
+/** Copies in_vec into out_vec and only reallocates out_vec if the sizes
+ * differ. */
+template <typename OutType, typename InType>
+void CopyVector(const InType &in_vec, OutType *out_vec) {
+	if (out_vec->size() != in_vec.size())
+		out_vec->resize (in_vec.size());
+
+	for (size_t i = 0; i < in_vec.size(); i++) {
+		(*out_vec)[i] = in_vec[i];
+	}
+}
+
 struct ModelFitter::ModelFitterInternal {
+	ModelFitterInternal() :
+		maxSteps (0)
+	{}
+
+	/// maximum number of IK steps (0: use ModelFitter::maxSteps)
+	unsigned int maxSteps;
 	rbdlVectorNd Qinit;
 	rbdlVectorNd Qres;
-	std::map<std::string, int> marker_residual_index;
+	/// body ids and points of all markers of the fitting plan
 	std::vector<unsigned int> body_ids;
 	std::vector<rbdlVector3d> body_points;
 	std::vector<rbdlVector3d> target_pos;
+	/// whether a marker has valid data and is therefore fitted
+	std::vector<bool> target_valid;
+	IKWorkspace workspace;
+};
+
+/** All markers of the model together with the bodies they are attached
+ * to and their index in the marker data.
+ *
+ * Compiling the plan queries the LuaTable of the model which must not be
+ * accessed concurrently. Fitting threads therefore only use a plan that
+ * was compiled beforehand. The plan is only recompiled when the model, its
+ * markers or the marker data change.
+ */
+struct ModelFitter::FittingPlan {
+	FittingPlan() :
+		model (NULL),
+		data (NULL),
+		modelRevision (0),
+		modelHash (0)
+	{}
+
+	/// model, marker data and model revision the plan was compiled for
+	Model *model;
+	MarkerData *data;
+	unsigned int modelRevision;
+	/// hash of the serialized model (0 until computed by calcParameterHash())
+	uint64_t modelHash;
+
 	std::vector<string> marker_names;
+	std::vector<unsigned int> body_ids;
+	std::vector<rbdlVector3d> body_points;
+	/// index of the marker in the MarkerData (-1 if it has no data)
+	std::vector<int> data_marker_indices;
 };
 
-ModelFitter::ModelFitter() {
+/** A range of frames that is fitted by a single worker thread.
+ *
+ * Fitting starts at seed_frame to warm start the first frame of the chunk,
+ * however only the results of [first_frame, last_frame] are kept.
+ */
+struct FitChunk {
+	int seed_frame;
+	int first_frame;
+	int last_frame;
+};
+
+ModelFitter::ModelFitter() :
+	threadCount (1),
+	chunkOverlap (20),
+	chunkTolerance (1.0e-6),
+	linearSolver (IKSolverLLT),
+	systemForm (IKSystemAuto),
+	sparseJacobian (true),
+	warmStart (IKWarmStartPrevious),
+	coarseStride (1),
+	refineSteps (10),
+	rootInitialization (false),
+	jacobianUpdateInterval (1),
+	logFormat (FittingLogCSV),
+	animationSteps (0),
+	animationCachedFrames (0) {
 	internal = new ModelFitterInternal();
+	plan = new FittingPlan();
+	fittingLog = new FittingLog();
+	fitCache = new FitCache();
 }
 
 ModelFitter::ModelFitter (Model *model, MarkerData *data, unsigned int maxSteps) :
@@ -67,264 +155,454 @@ ModelFitter::ModelFitter (Model *model, MarkerData *data, unsigned int maxSteps)
 		tolerance (1.0e-8),
 		success (false),
 		steps (0),
-		maxSteps (maxSteps)
+		maxSteps (maxSteps),
+		threadCount (1),
+		chunkOverlap (20),
+		chunkTolerance (1.0e-6),
+		linearSolver (IKSolverLLT),
+		systemForm (IKSystemAuto),
+		sparseJacobian (true),
+		warmStart (IKWarmStartPrevious),
+		coarseStride (1),
+		refineSteps (10),
+		rootInitialization (false),
+		jacobianUpdateInterval (1),
+		logFormat (FittingLogCSV),
+		animationSteps (0),
+		animationCachedFrames (0)
 	{
 		internal = new ModelFitterInternal();
+		plan = new FittingPlan();
+		fittingLog = new FittingLog();
+		fitCache = new FitCache();
 	}
 
 ModelFitter::~ModelFitter() {
 	delete internal;
+	delete plan;
+	delete fittingLog;
+	delete fitCache;
 }
 
-/** Inverse Kinematics using a Levenberg Marquardt with constant lambda
- */
-bool LevenbergMarquardtIK (
-		RigidBodyDynamics::Model &model,
-		const rbdlVectorNd &Qinit,
-		const std::vector<unsigned int>& body_id,
-		const std::vector<rbdlVector3d>& body_point,
-		const std::vector<rbdlVector3d>& target_pos,
-		rbdlVectorNd &Qres,
-		double step_tol,
-		double lambda,
-		unsigned int max_iter,
-		unsigned int *steps,
-		VectorNd *residuals
-		) {
-
-	assert (Qinit.size() == model.q_size);
-	assert (body_id.size() == body_point.size());
-	assert (body_id.size() == target_pos.size());
-
-	rbdlMatrixNd J = rbdlMatrixNd::Zero(3 * body_id.size(), model.qdot_size);
-	rbdlVectorNd e = rbdlVectorNd::Zero(3 * body_id.size());
-
-	Qres = Qinit;
-
-	unsigned int ik_iter;
-
-	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
-		UpdateKinematicsCustom (model, &Qres, NULL, NULL);
-
-		for (unsigned int k = 0; k < body_id.size(); k++) {
-			rbdlMatrixNd G (rbdlMatrixNd::Zero(3, model.qdot_size));
-			CalcPointJacobian (model, Qres, body_id[k], body_point[k], G, false);
-			rbdlVector3d point_base = CalcBodyToBaseCoordinates (model, Qres, body_id[k], body_point[k], false);
-
-			for (unsigned int i = 0; i < 3; i++) {
-				for (unsigned int j = 0; j < model.qdot_size; j++) {
-					unsigned int row = k * 3 + i;
-					J(row, j) = G (i,j);
-				}
+double vec_average (const VectorNd &vec) {
+	double sum = 0.;
+	for (size_t i = 0; i < vec.size(); i++) 
+		sum += vec[i];
 
-				e[k * 3 + i] = target_pos[k][i] - point_base[i];
-			}
-		}
+	return sum / vec.size();
+}
+
+double vec_standard_deviation (const VectorNd &vec) {
+	double average = vec_average (vec);
+	double diff_sum = 0.;
+	for (size_t i = 0; i < vec.size(); i++) {
+		diff_sum += (vec[i] - average) * (vec[i] - average);
+	}
 
-		// abort if we are getting "close"
-		if (e.norm() < step_tol) {
-			*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-			*steps = ik_iter;
+	return sqrt (diff_sum / vec.size());
+}
 
-			return true;
-		}
+/** Resolves the markers of the plan in the given marker data (may be NULL
+ * in which case no marker has data). Does not access the model and can
+ * therefore be called from any thread.
+ */
+void assign_marker_data (MarkerData *data, ModelFitter::FittingPlan *plan) {
+	plan->data = data;
+	plan->data_marker_indices.resize (plan->marker_names.size());
+
+	for (size_t mi = 0; mi < plan->marker_names.size(); mi++) {
+		plan->data_marker_indices[mi] = -1;
+		if (data)
+			plan->data_marker_indices[mi] = data->getMarkerIndex (plan->marker_names[mi].c_str());
+	}
+}
+
+/** Compiles the fitting plan for the markers of the model and the given
+ * marker data. Has to be called from the thread that owns the model.
+ */
+void compile_fitting_plan (Model *model, MarkerData *data, ModelFitter::FittingPlan *plan) {
+	plan->model = model;
+	plan->modelRevision = model->revision;
+	plan->modelHash = 0;
+
+	plan->marker_names.clear();
+	plan->body_ids.clear();
+	plan->body_points.clear();
 
-		rbdlMatrixNd JJTe_lambda2_I = J * J.transpose() + lambda*lambda * rbdlMatrixNd::Identity(e.size(), e.size());
+	int frame_count = model->getFrameCount();
 
-		rbdlVectorNd z (body_id.size() * 3);
-		z = JJTe_lambda2_I.colPivHouseholderQr().solve (e);
+	for (int frame_id = 1; frame_id <= frame_count; frame_id++) {
+		unsigned int body_id = model->frameIdToRbdlId[frame_id];
+		vector<Vector3f> marker_coords = model->getFrameMarkerCoords(frame_id);
+		vector<string> marker_names = model->getFrameMarkerNames(frame_id);
 
-		rbdlVectorNd delta_theta = J.transpose() * z;
-		Qres = Qres + delta_theta;
+		assert (marker_coords.size() == marker_names.size());
 
-		if (delta_theta.norm() < step_tol) {
-			*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-			*steps = ik_iter;
-			return true;
+		for (size_t marker_idx = 0; marker_idx < marker_coords.size(); marker_idx++) {
+			plan->marker_names.push_back (marker_names[marker_idx]);
+			plan->body_ids.push_back (body_id);
+			plan->body_points.push_back (ConvertVector<rbdlVector3d, Vector3d> (marker_coords[marker_idx]));
 		}
 	}
 
-	*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-	*steps = ik_iter;
-
-	return false;
+	assign_marker_data (data, plan);
 }
 
-/** Inverse Kinematics method by Sugihara
+/** Sets up the fitting targets from the packed marker positions (3 values
+ * per marker of the plan). Markers that are not valid are not fitted.
  *
- * Sugihara, T., "Solvability-Unconcerned Inverse Kinematics by the
- * Levenberg–Marquardt Method," Robotics, IEEE Transactions on , vol.27, no.5,
- * pp.984,991, Oct. 2011 doi: 10.1109/TRO.2011.2148230
+ * If marker_valid is NULL a marker is considered valid if its position is
+ * neither zero nor further than 10m away from the origin (the same rule
+ * that MarkerData uses).
  */
-bool SugiharaIK (
-		RigidBodyDynamics::Model &model,
-		const rbdlVectorNd &Qinit,
-		const std::vector<unsigned int>& body_id,
-		const std::vector<rbdlVector3d>& body_point,
-		const std::vector<rbdlVector3d>& target_pos,
-		rbdlVectorNd &Qres,
-		double step_tol,
-		unsigned int max_iter,
-		unsigned int *steps,
-		VectorNd *residuals
-		) {
-
-	assert (Qinit.size() == model.q_size);
-	assert (body_id.size() == body_point.size());
-	assert (body_id.size() == target_pos.size());
-
-	rbdlMatrixNd J = rbdlMatrixNd::Zero(3 * body_id.size(), model.qdot_size);
-	rbdlVectorNd e = rbdlVectorNd::Zero(3 * body_id.size());
-
-	Qres = Qinit;
-
-	unsigned int ik_iter;
-
-	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
-		UpdateKinematicsCustom (model, &Qres, NULL, NULL);
-
-		for (unsigned int k = 0; k < body_id.size(); k++) {
-			rbdlMatrixNd G (rbdlMatrixNd::Zero(3, model.qdot_size));
-			CalcPointJacobian (model, Qres, body_id[k], body_point[k], G, false);
-			rbdlVector3d point_base = CalcBodyToBaseCoordinates (model, Qres, body_id[k], body_point[k], false);
-
-			for (unsigned int i = 0; i < 3; i++) {
-				for (unsigned int j = 0; j < model.qdot_size; j++) {
-					unsigned int row = k * 3 + i;
-					J(row, j) = G (i,j);
-				}
+void setup_targets (const ModelFitter::FittingPlan &plan, const VectorNd &marker_positions, const std::vector<bool> *marker_valid, ModelFitter::ModelFitterInternal *fit_data) {
+	assert (marker_positions.size() == 3 * plan.marker_names.size());
 
-				e[k * 3 + i] = target_pos[k][i] - point_base[i];
-			}
-		}
+	// assigning vectors of the same size does not reallocate them
+	fit_data->body_ids = plan.body_ids;
+	fit_data->body_points = plan.body_points;
+	fit_data->target_pos.resize (plan.marker_names.size());
+	fit_data->target_valid.resize (plan.marker_names.size());
+
+	for (size_t mi = 0; mi < plan.marker_names.size(); mi++) {
+		rbdlVector3d marker_data_pos (marker_positions[mi * 3], marker_positions[mi * 3 + 1], marker_positions[mi * 3 + 2]);
+
+		fit_data->target_pos[mi] = marker_data_pos;
+
+		if (marker_valid)
+			fit_data->target_valid[mi] = (*marker_valid)[mi];
+		else
+			fit_data->target_valid[mi] = marker_data_pos != rbdlVector3d (0., 0., 0.) && marker_data_pos.squaredNorm() <= 1.0e2;
+	}
+}
+
+/** Packs the positions of all markers of the plan at the given frame and
+ * looks up their validity in the precomputed validity of the marker data.
+ * Markers without valid data get the position (0, 0, 0).
+ */
+void gather_marker_positions (const ModelFitter::FittingPlan &plan, const MarkerData *data, int frame, VectorNd *marker_positions, std::vector<bool> *marker_valid) {
+	if (marker_positions->size() != 3 * plan.marker_names.size())
+		marker_positions->resize (3 * plan.marker_names.size());
+	marker_valid->resize (plan.marker_names.size());
 
-		double wn = 1.0e-3;
-		double Ek = 0.;
+	for (size_t mi = 0; mi < plan.marker_names.size(); mi++) {
+		int marker_index = plan.data_marker_indices[mi];
+		Vector3f position (0.f, 0.f, 0.f);
 
-		for (size_t ei = 0; ei < e.size(); ei ++) {
-			Ek += e[ei] * e[ei] * 0.5;
+		(*marker_valid)[mi] = marker_index >= 0 && data->isMarkerValid (marker_index, frame);
+		if ((*marker_valid)[mi])
+			position = data->getMarkerPosition (marker_index, frame);
+
+		for (size_t i = 0; i < 3; i++) {
+			(*marker_positions)[mi * 3 + i] = position[i];
 		}
+	}
+}
 
-		rbdlVectorNd ek = J.transpose() * e;
-		rbdlMatrixNd Wn = rbdlMatrixNd::Zero (Qres.size(), Qres.size());
+void calc_marker_errors (const VectorNd &marker_residuals, std::vector<double> *marker_errors) {
+	marker_errors->resize (marker_residuals.size() / 3);
 
-		assert (ek.size() == Qres.size());
+	for (size_t mi = 0; mi < marker_errors->size(); mi++) {
+		Vector3d marker_res (marker_residuals[mi * 3], marker_residuals[mi * 3 + 1], marker_residuals[mi * 3 + 2]); 
+		(*marker_errors)[mi] = marker_res.norm();
+	}
+}
+
+void FitStatePredictor::reset (const VectorNd &state) {
+	count = 0;
+	CopyVector (state, &q_last);
+}
 
-		for (size_t wi = 0; wi < Qres.size(); wi++) {
-//			Wn(wi, wi) = ek[wi] * ek[wi] * 0.5 + 1.0e-3;
-			Wn(wi, wi) = Ek + 1.0e-3;
+void FitStatePredictor::update (const VectorNd &fitted_state) {
+	if (count > 1)
+		CopyVector (q_last_1, &q_last_2);
+	if (count > 0)
+		CopyVector (q_last, &q_last_1);
+	CopyVector (fitted_state, &q_last);
+
+	if (method == IKWarmStartKalman) {
+		if (count == 0) {
+			CopyVector (fitted_state, &kalman_q);
+			kalman_qdot = VectorNd::Zero (fitted_state.size());
+			kalman_P00 = VectorNd::Zero (fitted_state.size());
+			kalman_P01 = VectorNd::Zero (fitted_state.size());
+			kalman_P11 = VectorNd::Zero (fitted_state.size());
+			for (size_t i = 0; i < fitted_state.size(); i++) {
+				kalman_P00[i] = measurementNoise;
+				kalman_P11[i] = 1.;
+			}
+		} else {
+			for (size_t i = 0; i < fitted_state.size(); i++) {
+				// prediction with constant velocity
+				double q = kalman_q[i] + kalman_qdot[i];
+				double qdot = kalman_qdot[i];
+				double P00 = kalman_P00[i] + 2. * kalman_P01[i] + kalman_P11[i] + 0.25 * processNoise;
+				double P01 = kalman_P01[i] + kalman_P11[i] + 0.5 * processNoise;
+				double P11 = kalman_P11[i] + processNoise;
+
+				// correction with the fitted position
+				double S = P00 + measurementNoise;
+				double K0 = P00 / S;
+				double K1 = P01 / S;
+				double innovation = fitted_state[i] - q;
+
+				kalman_q[i] = q + K0 * innovation;
+				kalman_qdot[i] = qdot + K1 * innovation;
+				kalman_P00[i] = (1. - K0) * P00;
+				kalman_P01[i] = (1. - K0) * P01;
+				kalman_P11[i] = P11 - K1 * P01;
+			}
 		}
+	}
 
-		rbdlMatrixNd A = J.transpose() * J + Wn;
-		rbdlVectorNd delta_theta = A.colPivHouseholderQr().solve(J.transpose() * e);
-		Qres = Qres + delta_theta;
+	count++;
+}
 
-		if (delta_theta.norm() < step_tol) {
-			*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-			*steps = ik_iter;
+void FitStatePredictor::predict (VectorNd *state) const {
+	CopyVector (q_last, state);
 
-			return true;
+	if (method == IKWarmStartKalman && count > 0) {
+		for (size_t i = 0; i < state->size(); i++) {
+			(*state)[i] = kalman_q[i] + kalman_qdot[i];
+		}
+	} else if (method == IKWarmStartAcceleration && count > 2) {
+		for (size_t i = 0; i < state->size(); i++) {
+			(*state)[i] = 3. * q_last[i] - 3. * q_last_1[i] + q_last_2[i];
+		}
+	} else if ((method == IKWarmStartVelocity || method == IKWarmStartAcceleration) && count > 1) {
+		for (size_t i = 0; i < state->size(); i++) {
+			(*state)[i] = 2. * q_last[i] - q_last_1[i];
 		}
 	}
+}
+
+struct ModelFitter::FitContext {
+	FitContext (const RigidBodyDynamics::Model &model) :
+		rbdl_model (model),
+		rootTracked (false) {
+		root.initialize (rbdl_model);
+	}
+
+	RigidBodyDynamics::Model rbdl_model;
+	FittingPlan plan;
+	ModelFitterInternal fit_data;
+	VectorNd marker_positions;
+	/// validity of the marker positions (see gather_marker_positions())
+	std::vector<bool> marker_valid;
+
+	RootFreeFlyer root;
+	/// whether the root markers were visible in the previous fit
+	bool rootTracked;
+	rbdlVectorNd root_state;
+};
+
+void ModelFitter::updateFittingPlan () {
+	assert (model);
 
-	*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-	*steps = ik_iter;
+	if (plan->model == model && plan->data == data && plan->modelRevision == model->revision)
+		return;
 
-	return false;
+	compile_fitting_plan (model, data, plan);
 }
 
-bool SugiharaTaskSpaceIK (
-		RigidBodyDynamics::Model &model,
-		const rbdlVectorNd &Qinit,
-		const std::vector<unsigned int>& body_id,
-		const std::vector<rbdlVector3d>& body_point,
-		const std::vector<rbdlVector3d>& target_pos,
-		rbdlVectorNd &Qres,
-		double step_tol,
-		unsigned int max_iter,
-		unsigned int *steps,
-		VectorNd *residuals
-		) {
+ModelFitter::FitContext* ModelFitter::createFitContext () {
+	updateFittingPlan();
 
-	assert (Qinit.size() == model.q_size);
-	assert (body_id.size() == body_point.size());
-	assert (body_id.size() == target_pos.size());
+	FitContext *context = new FitContext (*(model->rbdlModel));
+	context->plan = *plan;
 
-	rbdlMatrixNd J = rbdlMatrixNd::Zero(3 * body_id.size(), model.qdot_size);
-	rbdlVectorNd e = rbdlVectorNd::Zero(3 * body_id.size());
+	return context;
+}
 
-	Qres = Qinit;
+void ModelFitter::destroyFitContext (FitContext *context) const {
+	delete context;
+}
 
-	unsigned int ik_iter;
+void ModelFitter::countMissingMarkers (const FitContext *context, int frame_first, int frame_last, std::vector<int> *missing_counts) const {
+	const FittingPlan &plan = context->plan;
+	missing_counts->resize (plan.marker_names.size(), 0);
 
-	for (ik_iter = 0; ik_iter < max_iter; ik_iter++) {
-		UpdateKinematicsCustom (model, &Qres, NULL, NULL);
+	for (size_t mi = 0; mi < plan.marker_names.size(); mi++) {
+		int missing_count = frame_last - frame_first + 1;
+		if (plan.data_marker_indices[mi] >= 0)
+			missing_count = plan.data->getMissingFrameCount (plan.data_marker_indices[mi], frame_first, frame_last);
 
-		for (unsigned int k = 0; k < body_id.size(); k++) {
-			rbdlMatrixNd G (rbdlMatrixNd::Zero(3, model.qdot_size));
-			CalcPointJacobian (model, Qres, body_id[k], body_point[k], G, false);
-			rbdlVector3d point_base = CalcBodyToBaseCoordinates (model, Qres, body_id[k], body_point[k], false);
+		(*missing_counts)[mi] += missing_count;
+	}
+}
 
-			for (unsigned int i = 0; i < 3; i++) {
-				for (unsigned int j = 0; j < model.qdot_size; j++) {
-					unsigned int row = k * 3 + i;
-					J(row, j) = G (i,j);
-				}
+void ModelFitter::printMissingMarkerSummary (const FitContext *context, int frame_first, int frame_last) const {
+	std::vector<int> missing_counts;
+	countMissingMarkers (context, frame_first, frame_last, &missing_counts);
+	printMissingMarkerSummary (context, frame_first, frame_last, missing_counts);
+}
 
-				e[k * 3 + i] = target_pos[k][i] - point_base[i];
-			}
-		}
+void ModelFitter::printMissingMarkerSummary (const FitContext *context, int frame_first, int frame_last, const std::vector<int> &missing_counts) const {
+	const FittingPlan &plan = context->plan;
+	std::ostringstream summary;
+	int missing_marker_count = 0;
 
-		// abort if we are getting "close"
-		if (e.norm() < step_tol) {
-			*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-			*steps = ik_iter;
+	for (size_t mi = 0; mi < plan.marker_names.size(); mi++) {
+		if (missing_counts[mi] == 0)
+			continue;
 
-			return true;
-		}
+		summary << "  " << plan.marker_names[mi] << ": " << missing_counts[mi] << " frames";
+		if (plan.data_marker_indices[mi] < 0)
+			summary << " (no data)";
+		summary << std::endl;
+		missing_marker_count++;
+	}
 
-		double wn = 1.0e-3;
-		rbdlMatrixNd Ek = rbdlMatrixNd::Zero (e.size(), e.size());
-	
-		for (size_t ei = 0; ei < e.size(); ei ++) {
-			Ek(ei,ei) = e[ei] * e[ei] * 0.5 + wn;
-		}
+	if (missing_marker_count == 0)
+		return;
+
+	// written at once as fits of several trials may run concurrently
+	cerr << "Warning: invalid marker data for " << missing_marker_count << " markers in frames "
+		<< frame_first << " to " << frame_last << ". These markers were not fitted at:" << endl
+		<< summary.str();
+}
 
-		rbdlMatrixNd JJT_Ek_wnI = J * J.transpose() + Ek;
+void ModelFitter::setFitContextData (FitContext *context, MarkerData *marker_data) const {
+	assign_marker_data (marker_data, &context->plan);
+	context->rootTracked = false;
+}
 
-		rbdlVectorNd delta_theta = J.transpose() * JJT_Ek_wnI.colPivHouseholderQr().solve (e);
+const std::vector<std::string>& ModelFitter::getFitMarkerNames (const FitContext *context) const {
+	return context->plan.marker_names;
+}
 
-		Qres = Qres + delta_theta;
-		if (delta_theta.norm() < step_tol) {
-			*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-			*steps = ik_iter;
+bool fit_targets (const ModelFitter &fitter, ModelFitter::FitContext *context, const VectorNd &marker_positions, const std::vector<bool> *marker_valid, const VectorNd &q_init, VectorNd *q_fitted, VectorNd *marker_residuals, unsigned int *steps) {
+	ModelFitter::ModelFitterInternal &fit_data = context->fit_data;
 
-			return true;
-		}
+	setup_targets (context->plan, marker_positions, marker_valid, &fit_data);
+
+	CopyVector (q_init, &fit_data.Qinit);
+
+	// the root pose is initialized in closed form at the start of a fit and
+	// when the root markers reappear after a gap
+	if (fitter.rootInitialization) {
+		CopyVector (fit_data.Qinit, &context->root_state);
+		bool root_visible = calc_root_pose_initialization (context->rbdl_model, context->root, fit_data.body_ids, fit_data.body_points, fit_data.target_pos, fit_data.target_valid, context->root_state);
+
+		if (root_visible && !context->rootTracked)
+			CopyVector (context->root_state, &fit_data.Qinit);
+
+		context->rootTracked = root_visible;
 	}
 
-	*residuals = ConvertVector<VectorNd, rbdlVectorNd> (e);
-	*steps = ik_iter;
+	fit_data.workspace.jacobianUpdateInterval = fitter.jacobianUpdateInterval;
+	bool result = fitter.solve (context->rbdl_model, &fit_data, steps, marker_residuals);
+	CopyVector (fit_data.Qres, q_fitted);
 
-	return false;
+	return result;
 }
 
-double vec_average (const VectorNd &vec) {
-	double sum = 0.;
-	for (size_t i = 0; i < vec.size(); i++) 
-		sum += vec[i];
+bool ModelFitter::fitFrame (FitContext *context, int frame, const VectorNd &q_init, VectorNd *q_fitted, VectorNd *marker_residuals, unsigned int *fit_steps) const {
+	gather_marker_positions (context->plan, context->plan.data, frame, &context->marker_positions, &context->marker_valid);
 
-	return sum / vec.size();
+	return fit_targets (*this, context, context->marker_positions, &context->marker_valid, q_init, q_fitted, marker_residuals, fit_steps);
 }
 
-double vec_standard_deviation (const VectorNd &vec) {
-	double average = vec_average (vec);
-	double diff_sum = 0.;
-	for (size_t i = 0; i < vec.size(); i++) {
-		diff_sum += (vec[i] - average) * (vec[i] - average);
+bool ModelFitter::fitMarkerPositions (FitContext *context, const VectorNd &marker_positions, const VectorNd &q_init, VectorNd *q_fitted, VectorNd *marker_residuals, unsigned int *fit_steps) const {
+	return fit_targets (*this, context, marker_positions, NULL, q_init, q_fitted, marker_residuals, fit_steps);
+}
+
+bool fit_frame (const ModelFitter &fitter, ModelFitter::FitContext *context, int frame, const VectorNd &q_init, FittedFrame *result) {
+	VectorNd marker_residuals;
+	result->success = fitter.fitFrame (context, frame, q_init, &result->state, &marker_residuals, &result->steps);
+	calc_marker_errors (marker_residuals, &result->markerErrors);
+
+	return result->success;
+}
+
+/** Data shared by all worker threads of a parallel animation fit. */
+struct ParallelFitJob {
+	const ModelFitter *fitter;
+	VectorNd initial_state;
+	int frame_start;
+	std::vector<FitChunk> chunks;
+	std::atomic<size_t> next_chunk;
+	/// results of the frames starting at frame_start
+	FittedFrame *results;
+};
+
+void fit_chunks_worker (ParallelFitJob *job, ModelFitter::FitContext *context) {
+	FittedFrame seed_result;
+	FitStatePredictor predictor (job->fitter->warmStart);
+	VectorNd q;
+
+	size_t chunk_index;
+	while ((chunk_index = job->next_chunk++) < job->chunks.size()) {
+		const FitChunk &chunk = job->chunks[chunk_index];
+		predictor.reset (job->initial_state);
+		context->rootTracked = false;
+
+		for (int frame = chunk.seed_frame; frame <= chunk.last_frame; frame++) {
+			FittedFrame *result = &seed_result;
+			if (frame >= chunk.first_frame)
+				result = &(job->results[frame - job->frame_start]);
+
+			predictor.predict (&q);
+			fit_frame (*job->fitter, context, frame, q, result);
+			predictor.update (result->state);
+		}
 	}
+}
 
-	return sqrt (diff_sum / vec.size());
+/** Data shared by all worker threads that refine the frames between the
+ * key frames of a coarse-to-fine fit. */
+struct RefineFitJob {
+	const ModelFitter *fitter;
+	int frame_start;
+	/// frames that were fitted with the full number of steps
+	std::vector<int> key_frames;
+	std::atomic<size_t> next_segment;
+	/// results of the frames starting at frame_start
+	FittedFrame *results;
+};
+
+/** Refines the frames between key frames. The initial state of each
+ * frame is interpolated from the surrounding key frames and fitted with
+ * at most ModelFitter::refineSteps steps. Frames that do not converge
+ * within this budget are continued with the full number of steps.
+ */
+void refine_segments_worker (RefineFitJob *job, ModelFitter::FitContext *context) {
+	FittedFrame *results = job->results;
+	const std::vector<int> &key_frames = job->key_frames;
+	FittedFrame continued;
+	VectorNd q;
+
+	size_t segment;
+	while ((segment = job->next_segment++) + 1 < key_frames.size()) {
+		if (key_frames[segment + 1] - key_frames[segment] < 2)
+			continue;
+
+		// The Catmull-Rom tangents of a segment only depend on its
+		// neighbouring key frames, therefore the local spline is identical
+		// to the spline through all key frames.
+		SplineInterpolator<VectorNd> spline;
+		size_t first = segment > 0 ? segment - 1 : segment;
+		size_t last = std::min (segment + 2, key_frames.size() - 1);
+		for (size_t ki = first; ki <= last; ki++) {
+			spline.addPoints (static_cast<double>(key_frames[ki]), results[key_frames[ki] - job->frame_start].state);
+		}
+
+		for (int frame = key_frames[segment] + 1; frame < key_frames[segment + 1]; frame++) {
+			FittedFrame &fitted = results[frame - job->frame_start];
+			q = spline.getValues (static_cast<double>(frame));
+			context->rootTracked = true;
+
+			context->fit_data.maxSteps = job->fitter->refineSteps;
+			fit_frame (*job->fitter, context, frame, q, &fitted);
+			context->fit_data.maxSteps = 0;
+
+			if (!fitted.success) {
+				fit_frame (*job->fitter, context, frame, fitted.state, &continued);
+				continued.steps += fitted.steps;
+				fitted = continued;
+			}
+		}
+	}
 }
 
 void ModelFitter::setup() {
@@ -335,39 +613,229 @@ void ModelFitter::setup() {
 	internal->Qres = ConvertVector<rbdlVectorNd, VectorNd> (initialState);
 	residuals = VectorNd::Zero (initialState.size());
 
-	internal->body_ids.clear();
-	internal->body_points.clear();
-	internal->target_pos.clear();
-	internal->marker_residual_index.clear();
-	internal->marker_names.clear();
+	VectorNd marker_positions;
+	std::vector<bool> marker_valid;
+	updateFittingPlan();
+	gather_marker_positions (*plan, data, data->currentFrame, &marker_positions, &marker_valid);
+	setup_targets (*plan, marker_positions, &marker_valid, internal);
+}
 
-	int frame_count = model->getFrameCount();
-	int residual_index = 0;
+bool ModelFitter::run (const VectorNd &_initialState) {
+	initialState = _initialState;
 
-	for (int frame_id = 1; frame_id <= frame_count; frame_id++) {
-		unsigned int body_id = model->frameIdToRbdlId[frame_id];
-		vector<Vector3f> marker_coords = model->getFrameMarkerCoords(frame_id);
-		vector<string> marker_names = model->getFrameMarkerNames(frame_id);
+	setup();
 
-		assert (marker_coords.size() == marker_names.size());
+	internal->workspace.jacobianUpdateInterval = jacobianUpdateInterval;
+	success = solve (*(model->rbdlModel), internal, &steps, &residuals);
+	fittedState = ConvertVector<VectorNd, rbdlVectorNd> (internal->Qres);
 
-		for (size_t marker_idx = 0; marker_idx < marker_coords.size(); marker_idx++) {
-			rbdlVector3d marker_data_pos = ConvertVector<rbdlVector3d, Vector3d> (data->getMarkerCurrentPosition (marker_names[marker_idx].c_str()));
-			internal->marker_names.push_back(marker_names[marker_idx]);
+	return success;
+}
 
-			if (marker_data_pos == rbdlVector3d (0., 0., 0.) || marker_data_pos.squaredNorm() > 1.0e2) {
-				cerr << "Warning: invalid marker data for marker '" << marker_names[marker_idx] << "' at frame " << data->currentFrame << ". Not fitting to this marker." << endl;
-				internal->marker_residual_index[marker_names[marker_idx]] = -1;
-				continue;
+uint64_t ModelFitter::calcParameterHash (const VectorNd &_initialState) {
+	updateFittingPlan();
+
+	if (plan->modelHash == 0) {
+		std::string model_string = model->luaTable->orderedSerialize();
+		plan->modelHash = hash_bytes (model_string.c_str(), model_string.size());
+	}
+
+	unsigned int thread_count = threadCount;
+	if (thread_count == 0)
+		thread_count = std::max (1u, std::thread::hardware_concurrency());
+
+	ostringstream parameters;
+	parameters << setprecision (17)
+		<< getMethodParameters() << ", "
+		<< "maxSteps " << maxSteps << ", "
+		<< "tolerance " << tolerance << ", "
+		<< "linearSolver " << linearSolver << ", "
+		<< "systemForm " << systemForm << ", "
+		<< "sparseJacobian " << sparseJacobian << ", "
+		<< "warmStart " << warmStart << ", "
+		<< "coarseStride " << coarseStride << ", "
+		<< "refineSteps " << refineSteps << ", "
+		<< "rootInitialization " << rootInitialization << ", "
+		<< "jacobianUpdateInterval " << jacobianUpdateInterval << ", "
+		<< "threads " << thread_count << ", "
+		<< "chunkOverlap " << chunkOverlap << ", "
+		<< "chunkTolerance " << chunkTolerance << ", "
+		<< "initialState";
+	for (size_t i = 0; i < _initialState.size(); i++) {
+		parameters << " " << _initialState[i];
+	}
+
+	std::string parameter_string = parameters.str();
+	return hash_bytes (parameter_string.c_str(), parameter_string.size(), plan->modelHash);
+}
+
+std::string ModelFitter::getLogFilename () const {
+	if (logFilename.size() > 0)
+		return logFilename;
+
+	if (logFormat == FittingLogBinary)
+		return "fitting_log.bin";
+
+	return "fitting_log.csv";
+}
+
+void ModelFitter::openLog (const std::vector<std::string> &marker_names, bool append) {
+	if (logFormat == FittingLogNone) {
+		fittingLog->close();
+		return;
+	}
+
+	std::string filename = getLogFilename();
+
+	// continue writing to the log if it is still open
+	if (append && fittingLog->isOpen() && fittingLog->format == logFormat && fittingLog->filename == filename && fittingLog->markerCount == marker_names.size())
+		return;
+
+	fittingLog->open (filename.c_str(), logFormat, marker_names, append);
+}
+
+/** Fits the key frames of a coarse-to-fine fit of the frames in
+ * [frame_start, frame_end] sequentially with all steps and sets up the job
+ * that refines the frames in between. */
+void fit_key_frames (const ModelFitter &fitter, ModelFitter::FitContext *context, const VectorNd &initial_state, int frame_start, int frame_end, FittedFrame *fitted_frames, RefineFitJob *job) {
+	job->fitter = &fitter;
+	job->frame_start = frame_start;
+	job->next_segment = 0;
+	job->results = fitted_frames;
+
+	for (int frame = frame_start; frame < frame_end; frame += fitter.coarseStride) {
+		job->key_frames.push_back (frame);
+	}
+	job->key_frames.push_back (frame_end);
+
+	FitStatePredictor predictor (fitter.warmStart);
+	predictor.reset (initial_state);
+	VectorNd q;
+
+	for (size_t ki = 0; ki < job->key_frames.size(); ki++) {
+		FittedFrame &fitted = fitted_frames[job->key_frames[ki] - frame_start];
+		predictor.predict (&q);
+		fit_frame (fitter, context, job->key_frames[ki], q, &fitted);
+		predictor.update (fitted.state);
+	}
+}
+
+void ModelFitter::fitFrameRange (FitContext *context, const VectorNd &_initialState, int frame_start, int frame_end, FittedFrame *fitted_frames) {
+	unsigned int thread_count = threadCount;
+	if (thread_count == 0)
+		thread_count = std::max (1u, std::thread::hardware_concurrency());
+
+	int frame_count = frame_end - frame_start + 1;
+
+	if (thread_count > 1 && coarseStride > 1) {
+		RefineFitJob job;
+		fit_key_frames (*this, context, _initialState, frame_start, frame_end, fitted_frames, &job);
+
+		// the frames in between are independent of each other
+		size_t segment_count = job.key_frames.size() - 1;
+		if (segment_count > 1) {
+			std::vector<FitContext*> worker_contexts;
+			std::vector<std::thread> workers;
+			for (unsigned int ti = 0; ti < std::min (thread_count, static_cast<unsigned int>(segment_count)); ti++) {
+				worker_contexts.push_back (createFitContext());
+			}
+			for (size_t ti = 0; ti < worker_contexts.size(); ti++) {
+				workers.push_back (std::thread (refine_segments_worker, &job, worker_contexts[ti]));
+			}
+			for (size_t ti = 0; ti < workers.size(); ti++) {
+				workers[ti].join();
+				destroyFitContext (worker_contexts[ti]);
+			}
+		} else {
+			refine_segments_worker (&job, context);
+		}
+	} else if (coarseStride <= 1 && thread_count > 1 && frame_count > static_cast<int>(thread_count * chunkOverlap)) {
+		ParallelFitJob job;
+		job.fitter = this;
+		job.initial_state = _initialState;
+		job.frame_start = frame_start;
+		job.next_chunk = 0;
+		job.results = fitted_frames;
+
+		// use more chunks than threads to balance the load of the workers
+		int min_chunk_size = std::max (1, static_cast<int>(chunkOverlap));
+		int chunk_count = std::min (static_cast<int>(thread_count * 4), frame_count / min_chunk_size);
+		int chunk_size = (frame_count + chunk_count - 1) / chunk_count;
+
+		for (int first = frame_start; first <= frame_end; first += chunk_size) {
+			FitChunk chunk;
+			chunk.first_frame = first;
+			chunk.last_frame = std::min (first + chunk_size - 1, frame_end);
+			chunk.seed_frame = std::max (frame_start, first - static_cast<int>(chunkOverlap));
+			job.chunks.push_back (chunk);
+		}
+
+		// contexts have to be created on this thread as it queries the model
+		std::vector<FitContext*> worker_contexts;
+		std::vector<std::thread> workers;
+		for (unsigned int ti = 0; ti < std::min (thread_count, static_cast<unsigned int>(job.chunks.size())); ti++) {
+			worker_contexts.push_back (createFitContext());
+		}
+		for (size_t ti = 0; ti < worker_contexts.size(); ti++) {
+			workers.push_back (std::thread (fit_chunks_worker, &job, worker_contexts[ti]));
+		}
+		for (size_t ti = 0; ti < workers.size(); ti++) {
+			workers[ti].join();
+			destroyFitContext (worker_contexts[ti]);
+		}
+
+		// Apart from the first chunk all chunks were started from a different
+		// state than in a sequential fit. We therefore re-fit the first frames
+		// of each chunk starting from the last frame of the previous chunk
+		// until the re-fit agrees with the parallel fit.
+		FittedFrame refit;
+		FitStatePredictor predictor (warmStart);
+		VectorNd q;
+		for (size_t ci = 1; ci < job.chunks.size(); ci++) {
+			// the predictor continues from the last states of the previous chunk
+			int chunk_offset = job.chunks[ci].first_frame - frame_start;
+			predictor.reset (_initialState);
+			for (int fi = std::max (0, chunk_offset - 3); fi < chunk_offset; fi++) {
+				predictor.update (fitted_frames[fi].state);
 			}
+			context->rootTracked = true;
+
+			for (int frame = job.chunks[ci].first_frame; frame <= job.chunks[ci].last_frame; frame++) {
+				FittedFrame &fitted = fitted_frames[frame - frame_start];
+				predictor.predict (&q);
+				fit_frame (*this, context, frame, q, &refit);
 
-			internal->marker_residual_index[marker_names[marker_idx]] = residual_index;
-			residual_index++;
+				bool agrees = (refit.state - fitted.state).norm() < chunkTolerance;
+				fitted = refit;
+				predictor.update (refit.state);
 
-			internal->body_ids.push_back (body_id);
-			internal->body_points.push_back (ConvertVector<rbdlVector3d, Vector3d> (marker_coords[marker_idx]));
+				if (agrees)
+					break;
+			}
+		}
+	} else {
+		fitFrameRangeSequential (context, _initialState, false, frame_start, frame_end, fitted_frames);
+	}
+}
 
-			internal->target_pos.push_back (marker_data_pos);
+void ModelFitter::fitFrameRangeSequential (FitContext *context, const VectorNd &_initialState, bool continued, int frame_start, int frame_end, FittedFrame *fitted_frames) const {
+	if (continued)
+		context->rootTracked = true;
+
+	if (coarseStride > 1) {
+		RefineFitJob job;
+		fit_key_frames (*this, context, _initialState, frame_start, frame_end, fitted_frames, &job);
+		refine_segments_worker (&job, context);
+	} else {
+		FitStatePredictor predictor (warmStart);
+		predictor.reset (_initialState);
+		VectorNd q;
+
+		for (int i = frame_start; i <= frame_end; i++) {
+			FittedFrame &fitted = fitted_frames[i - frame_start];
+			predictor.predict (&q);
+			fit_frame (*this, context, i, q, &fitted);
+			predictor.update (fitted.state);
 		}
 	}
 }
@@ -377,8 +845,6 @@ bool ModelFitter::computeModelAnimationFromMarkers (const VectorNd &_initialStat
 	assert (data);
 	assert (animation);
 
-	int old_current_frame = data->currentFrame;
-
 	double current_time = 0.;
 	double frame_rate = static_cast<double>(data->getFrameRate());
 	int frame_first = data->getFirstFrame();
@@ -391,61 +857,332 @@ bool ModelFitter::computeModelAnimationFromMarkers (const VectorNd &_initialStat
 	if (frame_end == -1 || frame_end > frame_last)
 		frame_end = frame_last;
 
-	ofstream iklog;
-	if (frame_start == frame_first) {
-		iklog.open("fitting_log.csv");
-		setup();
-	
-		iklog << "frame, steps, ";
-		for (size_t i = 0; i < internal->marker_names.size(); i++) {
-			iklog << internal->marker_names[i];
-			if (i != internal->marker_names.size() - 1)
-				iklog << ", ";
+	FitContext *context = createFitContext();
+	const std::vector<std::string> &marker_names = getFitMarkerNames (context);
+
+	openLog (marker_names, frame_start != frame_first);
+
+	int frame_count = frame_end - frame_start + 1;
+	std::vector<FittedFrame> fitted_frames (frame_count);
+	int fit_start = frame_start;
+	VectorNd initial_state = _initialState;
+	bool use_cache = false;
+
+	// The cache contains the frames from the first frame of the data up to
+	// the last frame that was fitted with the same parameters. Cached
+	// frames are not fitted again and the fit continues from the last
+	// cached pose.
+	if (cacheDirectory != "") {
+		std::string key = get_fit_cache_key (calcParameterHash (_initialState), data);
+		if (!fitCache->isOpen() || fitCache->key != key)
+			fitCache->open (cacheDirectory, key, frame_first, _initialState.size(), marker_names.size());
+
+		int cache_end = frame_first + static_cast<int>(fitCache->frames.size());
+		for (int frame = frame_start; frame <= std::min (cache_end - 1, frame_end); frame++) {
+			fitted_frames[frame - frame_start] = fitCache->frames[frame - frame_first];
+		}
+
+		// a fit that starts after the cached frames cannot be added to the
+		// cache
+		if (frame_start <= cache_end) {
+			use_cache = fitCache->isOpen();
+			fit_start = std::max (frame_start, cache_end);
+
+			if (cache_end > frame_first) {
+				initial_state = fitCache->frames[cache_end - 1 - frame_first].state;
+				context->rootTracked = true;
+			}
 		}
-		iklog << endl;
-	}	else {
-		iklog.open("fitting_log.csv", ios::app);
 	}
 
-	VectorNd current_state = _initialState;
+	animationCachedFrames = fit_start - frame_start;
+
+	// when using the cache the frames are fitted in blocks that are written
+	// to the cache before the next block is fitted
+	int block_size = frame_end - fit_start + 1;
+	if (use_cache)
+		block_size = FIT_CACHE_BLOCK_FRAMES;
+
+	for (int block_start = fit_start; block_start <= frame_end; block_start += block_size) {
+		int block_end = std::min (block_start + block_size - 1, frame_end);
+		fitFrameRange (context, initial_state, block_start, block_end, &fitted_frames[block_start - frame_start]);
+
+		initial_state = fitted_frames[block_end - frame_start].state;
+		context->rootTracked = true;
+
+		if (use_cache) {
+			for (int frame = block_start; frame <= block_end; frame++) {
+				fitCache->addFrame (fitted_frames[frame - frame_start]);
+			}
+			fitCache->flush();
+		}
+	}
 
+	animationSteps = 0;
 	for (int i = frame_start; i <= frame_end; i++) {
+		const FittedFrame &fitted = fitted_frames[i - frame_start];
+		animationSteps += fitted.steps;
 		current_time = static_cast<double>(i - frame_first) / static_cast<double>(frame_last - frame_first) * data_duration;
-		data->setCurrentFrameNumber (i);
 
-		if (!run (current_state)) {
+		if (!fitted.success) {
 			result = false;
 			cerr << "Warning: could not fit frame " << i << endl;
 		}
 
-		iklog << i - frame_first << ", ";
-		iklog << steps << ", ";
+		fittingLog->addFrame (i - frame_first, fitted.steps, fitted.markerErrors);
+
+		animation->addPose (current_time, fitted.state);
+	}
+
+	// the log stays open while the animation is fitted in several ranges
+	if (frame_end == frame_last) {
+		fittingLog->close();
+		printMissingMarkerSummary (context, frame_first, frame_last);
+	}
+
+	destroyFitContext (context);
+
+	return result;
+}
+
+bool ModelFitter::streamModelAnimationFromMarkers (const VectorNd &_initialState, int window_size, const char *animation_filename) {
+	assert (model);
+	assert (data);
+	assert (window_size > 0);
+
+	ofstream animation_file (animation_filename);
+	if (!animation_file) {
+		cerr << "Error: cannot write animation file " << animation_filename << endl;
+		return false;
+	}
+
+	double frame_rate = static_cast<double>(data->getFrameRate());
+	int frame_first = data->getFirstFrame();
+	int frame_last = data->getLastFrame();
+	bool result = true;
+
+	FitContext *context = createFitContext();
+	const std::vector<std::string> &marker_names = getFitMarkerNames (context);
+
+	openLog (marker_names, false);
+
+	std::vector<FittedFrame> fitted_frames (window_size);
+	std::vector<int> missing_counts;
+	VectorNd initial_state = _initialState;
+
+	animationSteps = 0;
+	animationCachedFrames = 0;
+
+	for (int window_start = frame_first; window_start <= frame_last; window_start += window_size) {
+		int window_end = std::min (window_start + window_size - 1, frame_last);
+
+		data->setFrameWindow (window_start, window_end);
+		fitFrameRange (context, initial_state, window_start, window_end, &fitted_frames[0]);
+		countMissingMarkers (context, window_start, window_end, &missing_counts);
+
+		// the next window continues from the last pose
+		initial_state = fitted_frames[window_end - window_start].state;
+		context->rootTracked = true;
+
+		for (int i = window_start; i <= window_end; i++) {
+			const FittedFrame &fitted = fitted_frames[i - window_start];
+			animationSteps += fitted.steps;
+
+			if (!fitted.success) {
+				result = false;
+				cerr << "Warning: could not fit frame " << i << endl;
+			}
+
+			fittingLog->addFrame (i - frame_first, fitted.steps, fitted.markerErrors);
+			write_animation_pose (animation_file, static_cast<double>(i - frame_first) / frame_rate, fitted.state);
+		}
+	}
+
+	fittingLog->close();
+	printMissingMarkerSummary (context, frame_first, frame_last, missing_counts);
+
+	destroyFitContext (context);
+
+	return result;
+}
+
+void ModelFitter::getMarkerFrames (const std::vector<std::string> &marker_names, std::vector<int> *frames) {
+	assert (data);
+	updateFittingPlan();
+
+	// only markers of the fitting plan influence the fitted poses
+	std::vector<int> data_marker_indices;
+	for (size_t mi = 0; mi < plan->marker_names.size(); mi++) {
+		if (plan->data_marker_indices[mi] >= 0
+				&& std::find (marker_names.begin(), marker_names.end(), plan->marker_names[mi]) != marker_names.end())
+			data_marker_indices.push_back (plan->data_marker_indices[mi]);
+	}
+
+	frames->clear();
+	if (data_marker_indices.size() == 0)
+		return;
 
-		for (size_t mi = 0; mi < internal->marker_names.size(); mi++) {
-			int ri = internal->marker_residual_index[internal->marker_names[mi]];
-			if (ri == -1) {
-				iklog << 0.;
-			} else {
-				Vector3d marker_res (residuals[ri * 3], residuals[ri * 3 + 1], residuals[ri * 3 + 2]); 
-				iklog << marker_res.norm();
+	for (int frame = data->getFirstFrame(); frame <= data->getLastFrame(); frame++) {
+		for (size_t i = 0; i < data_marker_indices.size(); i++) {
+			if (data->isMarkerValid (data_marker_indices[i], frame)) {
+				frames->push_back (frame);
+				break;
 			}
+		}
+	}
+}
+
+/** Data shared by all worker threads of a re-fit of animation frames. */
+struct RefitFramesJob {
+	const ModelFitter *fitter;
+	const Animation *animation;
+	int frame_first;
+	const std::vector<int> *frames;
+	std::atomic<size_t> next_frame;
+	std::vector<FittedFrame> *results;
+};
+
+void refit_frames_worker (RefitFramesJob *job, ModelFitter::FitContext *context) {
+	size_t index;
+	while ((index = job->next_frame++) < job->frames->size()) {
+		int frame = (*job->frames)[index];
+
+		// the previous pose is close to the solution and the root does not
+		// have to be re-initialized
+		context->rootTracked = true;
+		fit_frame (*job->fitter, context, frame, job->animation->keyFrames[frame - job->frame_first].state, &((*job->results)[index]));
+	}
+}
 
-			if (mi != internal->marker_names.size() - 1)
-				iklog << ", ";
+bool ModelFitter::refitAnimationFrames (Animation *animation, const std::vector<int> &frames) {
+	assert (model);
+	assert (data);
+	assert (animation);
+
+	int frame_first = data->getFirstFrame();
+	if (animation->keyFrames.size() != static_cast<size_t>(data->getLastFrame() - frame_first + 1)) {
+		cerr << "Error: cannot re-fit frames of an animation that does not contain a pose for each frame of the marker data." << endl;
+		return false;
+	}
+
+	animationSteps = 0;
+	if (frames.size() == 0)
+		return true;
+
+	unsigned int thread_count = threadCount;
+	if (thread_count == 0)
+		thread_count = std::max (1u, std::thread::hardware_concurrency());
+	thread_count = std::min (thread_count, static_cast<unsigned int>(frames.size()));
+
+	RefitFramesJob job;
+	job.fitter = this;
+	job.animation = animation;
+	job.frame_first = frame_first;
+	job.frames = &frames;
+	job.next_frame = 0;
+	std::vector<FittedFrame> fitted_frames (frames.size());
+	job.results = &fitted_frames;
+
+	// contexts have to be created on this thread as it queries the model
+	std::vector<FitContext*> worker_contexts;
+	for (unsigned int ti = 0; ti < thread_count; ti++) {
+		worker_contexts.push_back (createFitContext());
+	}
+
+	if (worker_contexts.size() > 1) {
+		std::vector<std::thread> workers;
+		for (size_t ti = 0; ti < worker_contexts.size(); ti++) {
+			workers.push_back (std::thread (refit_frames_worker, &job, worker_contexts[ti]));
+		}
+		for (size_t ti = 0; ti < workers.size(); ti++) {
+			workers[ti].join();
 		}
-		iklog << endl;
+	} else {
+		refit_frames_worker (&job, worker_contexts[0]);
+	}
 
-		current_state = getFittedState();
-		animation->addPose (current_time, current_state);
+	for (size_t ti = 0; ti < worker_contexts.size(); ti++) {
+		destroyFitContext (worker_contexts[ti]);
 	}
-	iklog.close();
 
-	data->currentFrame = old_current_frame;
+	bool result = true;
+	for (size_t i = 0; i < frames.size(); i++) {
+		animationSteps += fitted_frames[i].steps;
+
+		if (!fitted_frames[i].success) {
+			result = false;
+			cerr << "Warning: could not fit frame " << frames[i] << endl;
+		}
+
+		animation->keyFrames[frames[i] - frame_first].state = fitted_frames[i].state;
+	}
 
 	return result;
 }
 
-void ModelFitter::analyzeAnimation (Animation animation) {
+/** Data shared by all worker threads of an animation analysis. */
+struct AnalysisJob {
+	const Animation *animation;
+	int frame_first;
+	/// duration of a frame of the marker data
+	double frame_duration;
+	std::vector<FitChunk> chunks;
+	std::atomic<size_t> next_chunk;
+	/// distance of each marker at each frame (frames x markers, -1 if the
+	/// marker has no valid data)
+	std::vector<double> *marker_errors;
+};
+
+void analyze_chunks_worker (AnalysisJob *job, ModelFitter::FitContext *context) {
+	const ModelFitter::FittingPlan &plan = context->plan;
+	size_t marker_count = plan.marker_names.size();
+	std::vector<rbdlVector3d> &model_markers = context->fit_data.workspace.point_base;
+	rbdlVectorNd &q = context->fit_data.Qinit;
+	VectorNd pose;
+
+	size_t chunk_index;
+	while ((chunk_index = job->next_chunk++) < job->chunks.size()) {
+		const FitChunk &chunk = job->chunks[chunk_index];
+		size_t key_index = 0;
+
+		for (int frame = chunk.first_frame; frame <= chunk.last_frame; frame++) {
+			job->animation->getPoseAt ((frame - job->frame_first) * job->frame_duration, &key_index, &pose);
+			CopyVector (pose, &q);
+
+			gather_marker_positions (plan, plan.data, frame, &context->marker_positions, &context->marker_valid);
+
+			// a single kinematics update for all markers of the frame
+			calc_points_base_coordinates (context->rbdl_model, q, plan.body_ids, plan.body_points, model_markers);
+
+			double *frame_errors = &(*job->marker_errors)[(frame - job->frame_first) * marker_count];
+			const VectorNd &positions = context->marker_positions;
+			for (size_t mi = 0; mi < marker_count; mi++) {
+				frame_errors[mi] = -1.;
+				if (context->marker_valid[mi]) {
+					rbdlVector3d data_marker (positions[mi * 3], positions[mi * 3 + 1], positions[mi * 3 + 2]);
+					frame_errors[mi] = (data_marker - model_markers[mi]).norm();
+				}
+			}
+		}
+	}
+}
+
+/** Returns the value at the given fraction (0: smallest, 1: largest) of
+ * the sorted values using linear interpolation between the closest
+ * values. */
+double sorted_percentile (const std::vector<double> &sorted_values, double fraction) {
+	assert (sorted_values.size() > 0);
+
+	double position = fraction * static_cast<double>(sorted_values.size() - 1);
+	size_t lower = static_cast<size_t>(position);
+	if (lower + 1 >= sorted_values.size())
+		return sorted_values[sorted_values.size() - 1];
+
+	double weight = position - static_cast<double>(lower);
+	return (1. - weight) * sorted_values[lower] + weight * sorted_values[lower + 1];
+}
+
+void ModelFitter::analyzeAnimation (const Animation &animation, std::vector<MarkerErrorStatistics> *statistics) {
 	assert (model);
 	assert (data);
 
@@ -456,80 +1193,149 @@ void ModelFitter::analyzeAnimation (Animation animation) {
 
 	assert (data_duration == animation.getDuration());
 
-	ofstream iklog;
+	FitContext *context = createFitContext();
+	const FittingPlan &plan = context->plan;
+	size_t marker_count = plan.marker_names.size();
+	int frame_count = frame_last - frame_first + 1;
+
+	unsigned int thread_count = threadCount;
+	if (thread_count == 0)
+		thread_count = std::max (1u, std::thread::hardware_concurrency());
+
+	std::vector<double> marker_errors (frame_count * marker_count);
+
+	AnalysisJob job;
+	job.animation = &animation;
+	job.frame_first = frame_first;
+	job.frame_duration = data_duration / static_cast<double>(std::max (frame_last - frame_first, 1));
+	job.next_chunk = 0;
+	job.marker_errors = &marker_errors;
+
+	// several chunks per thread to balance the load
+	int chunk_size = std::max (1, frame_count / static_cast<int>(4 * thread_count));
+	for (int frame = frame_first; frame <= frame_last; frame += chunk_size) {
+		FitChunk chunk;
+		chunk.seed_frame = frame;
+		chunk.first_frame = frame;
+		chunk.last_frame = std::min (frame + chunk_size - 1, frame_last);
+		job.chunks.push_back (chunk);
+	}
+
+	if (thread_count == 1) {
+		analyze_chunks_worker (&job, context);
+	} else {
+		std::vector<FitContext*> worker_contexts;
+		std::vector<std::thread> workers;
+		for (unsigned int ti = 0; ti < thread_count; ti++) {
+			worker_contexts.push_back (createFitContext());
+			workers.push_back (std::thread (analyze_chunks_worker, &job, worker_contexts[ti]));
+		}
+		for (unsigned int ti = 0; ti < thread_count; ti++) {
+			workers[ti].join();
+			destroyFitContext (worker_contexts[ti]);
+		}
+	}
 
-	iklog.open("fitting_log.csv");
-	setup();
+	openLog (plan.marker_names, false);
+	std::vector<double> frame_errors (marker_count);
+
+	for (int fi = 0; fi < frame_count; fi++) {
+		for (size_t mi = 0; mi < marker_count; mi++) {
+			frame_errors[mi] = std::max (marker_errors[fi * marker_count + mi], 0.);
+		}
+
+		fittingLog->addFrame (fi, 0, frame_errors);
+	}
+	fittingLog->close();
+
+	printMissingMarkerSummary (context, frame_first, frame_last);
 
-	iklog << "frame, steps, ";
-	for (size_t i = 0; i < internal->marker_names.size(); i++) {
-		iklog << internal->marker_names[i];
-		if (i != internal->marker_names.size() - 1)
-			iklog << ", ";
-	}
-	iklog << endl;
-
-	for (int i = frame_first; i <= frame_last; i++) {
-		double current_time = static_cast<double>(i - frame_first) / static_cast<double>(frame_last - frame_first) * data_duration;
-		data->setCurrentFrameNumber (i);
-		animation.setCurrentTime (current_time);
-		rbdlVectorNd q = ConvertVector<rbdlVectorNd, VectorNd>(animation.getCurrentPose());
-
-		iklog << i - frame_first << ", ";
-		iklog << 0 << ", ";
-		
-		setup();
-
-		UpdateKinematicsCustom (*(model->rbdlModel), &q, NULL, NULL);
-
-		for (size_t mi = 0; mi < internal->marker_names.size(); mi++) {
-			string marker_name = internal->marker_names[mi];
-			int ri = internal->marker_residual_index[internal->marker_names[mi]];
-			if (ri == -1) {
-				iklog << 0.;
-			} else {
-				rbdlVector3d data_marker = internal->target_pos[mi];
-				rbdlVector3d model_marker = CalcBodyToBaseCoordinates (*(model->rbdlModel), q, internal->body_ids[mi], internal->body_points[mi], false);
-				iklog << (data_marker - model_marker).norm();
+	if (statistics) {
+		statistics->resize (marker_count);
+		std::vector<double> values;
+
+		for (size_t mi = 0; mi < marker_count; mi++) {
+			MarkerErrorStatistics &marker_statistics = (*statistics)[mi];
+			marker_statistics = MarkerErrorStatistics();
+			marker_statistics.markerName = plan.marker_names[mi];
+
+			values.clear();
+			for (int fi = 0; fi < frame_count; fi++) {
+				if (marker_errors[fi * marker_count + mi] >= 0.)
+					values.push_back (marker_errors[fi * marker_count + mi]);
 			}
 
-			if (mi != internal->marker_names.size() - 1)
-				iklog << ", ";
+			marker_statistics.frameCount = static_cast<int>(values.size());
+			marker_statistics.missingFrameCount = frame_count - marker_statistics.frameCount;
+			if (values.size() == 0)
+				continue;
+
+			VectorNd value_vector (values.size());
+			CopyVector (values, &value_vector);
+			marker_statistics.mean = vec_average (value_vector);
+			marker_statistics.standardDeviation = vec_standard_deviation (value_vector);
+
+			std::sort (values.begin(), values.end());
+			marker_statistics.median = sorted_percentile (values, 0.5);
+			marker_statistics.percentile95 = sorted_percentile (values, 0.95);
+			marker_statistics.max = values[values.size() - 1];
 		}
-		iklog << endl;
 	}
-	iklog.close();
+
+	destroyFitContext (context);
 }
 
-bool LevenbergMarquardtFitter::run (const VectorNd &_initialState) {
-	initialState = _initialState;
+unsigned int get_max_steps (const ModelFitter &fitter, const ModelFitter::ModelFitterInternal *fit_data) {
+	if (fit_data->maxSteps > 0)
+		return fit_data->maxSteps;
 
-	setup();
+	return fitter.maxSteps;
+}
 
-	success = LevenbergMarquardtIK (*(model->rbdlModel), internal->Qinit, internal->body_ids, internal->body_points, internal->target_pos, internal->Qres, tolerance, lambda, maxSteps, &steps, &residuals);
-	fittedState = ConvertVector<VectorNd, rbdlVectorNd> (internal->Qres);
+bool LevenbergMarquardtFitter::solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const {
+	bool result = LevenbergMarquardtIK (rbdl_model, fit_data->Qinit, fit_data->body_ids, fit_data->body_points, fit_data->target_pos, fit_data->target_valid, fit_data->Qres, tolerance, lambda, get_max_steps (*this, fit_data), linearSolver, systemForm, sparseJacobian, fit_data->workspace, steps);
+	CopyVector (fit_data->workspace.e, residuals);
 
-	return success;
+	return result;
 }
 
-bool SugiharaFitter::run (const VectorNd &_initialState) {
-	initialState = _initialState;
+std::string LevenbergMarquardtFitter::getMethodParameters () const {
+	ostringstream parameters;
+	parameters << setprecision (17) << "levenberg, lambda " << lambda;
+	return parameters.str();
+}
 
-	setup();
+bool SugiharaFitter::solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const {
+	bool result = SugiharaIK (rbdl_model, fit_data->Qinit, fit_data->body_ids, fit_data->body_points, fit_data->target_pos, fit_data->target_valid, fit_data->Qres, tolerance, get_max_steps (*this, fit_data), linearSolver, systemForm, sparseJacobian, fit_data->workspace, steps);
+	CopyVector (fit_data->workspace.e, residuals);
 
-	success = SugiharaIK (*(model->rbdlModel), internal->Qinit, internal->body_ids, internal->body_points, internal->target_pos, internal->Qres, tolerance, maxSteps, &steps, &residuals);
-	fittedState = ConvertVector<VectorNd, rbdlVectorNd> (internal->Qres);
+	return result;
+}
 
-	return success;
+std::string SugiharaFitter::getMethodParameters () const {
+	return "sugihara";
 }
 
-bool SugiharaTaskSpaceFitter::run (const VectorNd &_initialState) {
-	initialState = _initialState;
+bool SugiharaTaskSpaceFitter::solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const {
+	bool result = SugiharaTaskSpaceIK (rbdl_model, fit_data->Qinit, fit_data->body_ids, fit_data->body_points, fit_data->target_pos, fit_data->target_valid, fit_data->Qres, tolerance, get_max_steps (*this, fit_data), linearSolver, systemForm, sparseJacobian, fit_data->workspace, steps);
+	CopyVector (fit_data->workspace.e, residuals);
 
-	setup();
+	return result;
+}
 
-	success = SugiharaTaskSpaceIK (*(model->rbdlModel), internal->Qinit, internal->body_ids, internal->body_points, internal->target_pos, internal->Qres, tolerance, maxSteps, &steps, &residuals);
-	fittedState = ConvertVector<VectorNd, rbdlVectorNd> (internal->Qres);
+std::string SugiharaTaskSpaceFitter::getMethodParameters () const {
+	return "sugiharats";
+}
 
-	return success;
+bool AdaptiveLevenbergMarquardtFitter::solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const {
+	bool result = AdaptiveLevenbergMarquardtIK (rbdl_model, fit_data->Qinit, fit_data->body_ids, fit_data->body_points, fit_data->target_pos, fit_data->target_valid, fit_data->Qres, tolerance, gradientTolerance, dampingScale, get_max_steps (*this, fit_data), linearSolver, systemForm, sparseJacobian, fit_data->workspace, steps);
+	CopyVector (fit_data->workspace.e, residuals);
+
+	return result;
+}
+
+std::string AdaptiveLevenbergMarquardtFitter::getMethodParameters () const {
+	ostringstream parameters;
+	parameters << setprecision (17) << "adaptive, gradientTolerance " << gradientTolerance << ", dampingScale " << dampingScale;
+	return parameters.str();
 }
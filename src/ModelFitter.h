@@ -27,23 +27,200 @@
 #define MODEL_FITTER_H
 
 #include "SimpleMath/SimpleMath.h"
+#include "FittingLog.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace RigidBodyDynamics {
+	struct Model;
+}
 
 struct MarkerData;
 struct Model;
 struct Animation;
+struct FitCache;
+
+/** Decomposition used to solve the damped normal equations of the IK. */
+enum IKLinearSolver {
+	/// Cholesky decomposition
+	IKSolverLLT = 0,
+	/// Cholesky decomposition with pivoting
+	IKSolverLDLT,
+	/// QR decomposition with column pivoting
+	IKSolverQR
+};
+
+/** Form of the damped normal equations that is solved by the IK. */
+enum IKSystemForm {
+	/// uses the smaller of the two forms
+	IKSystemAuto = 0,
+	/// (dof count x dof count) system
+	IKSystemJointSpace,
+	/// (3 * marker count x 3 * marker count) system
+	IKSystemTaskSpace
+};
+
+/** Initial state of the IK of a frame when fitting an animation. */
+enum IKWarmStart {
+	/// state fitted at the previous frame
+	IKWarmStartPrevious = 0,
+	/// extrapolation of the previous states with constant velocity
+	IKWarmStartVelocity,
+	/// extrapolation of the previous states with constant acceleration
+	IKWarmStartAcceleration,
+	/// prediction of a Kalman filter with a constant velocity model
+	IKWarmStartKalman
+};
+
+/** Predicts the initial state of the IK at the next frame from the states
+ * that were fitted at the previous frames.
+ *
+ * The Kalman filter treats each degree of freedom separately with a
+ * constant velocity model. The noise variances are per frame.
+ */
+struct FitStatePredictor {
+	FitStatePredictor (IKWarmStart method = IKWarmStartPrevious) :
+		method (method),
+		processNoise (1.0e-4),
+		measurementNoise (1.0e-6),
+		count (0)
+	{}
+
+	/** Restarts the prediction. Until a state was fitted the given state
+	 * is predicted. */
+	void reset (const VectorNd &state);
+	/** Adds the state that was fitted at the next frame. */
+	void update (const VectorNd &fitted_state);
+	/** Computes the initial state for the next frame. */
+	void predict (VectorNd *state) const;
+
+	IKWarmStart method;
+	/// variance of the change of the velocity per frame
+	double processNoise;
+	/// variance of the fitted states
+	double measurementNoise;
+
+	/// number of fitted states since the last reset
+	unsigned int count;
+	/// last three fitted states (q_last is the most recent one)
+	VectorNd q_last;
+	VectorNd q_last_1;
+	VectorNd q_last_2;
+
+	/// Kalman filter estimates of position, velocity and their covariance
+	VectorNd kalman_q;
+	VectorNd kalman_qdot;
+	VectorNd kalman_P00;
+	VectorNd kalman_P01;
+	VectorNd kalman_P11;
+};
+
+/** Result of the fit of a single frame. */
+struct FittedFrame {
+	FittedFrame() :
+		steps (0),
+		success (false)
+	{}
+
+	VectorNd state;
+	unsigned int steps;
+	bool success;
+	/// residual norm of each marker of the fitting plan (0. if not fitted)
+	std::vector<double> markerErrors;
+};
+
+/** Statistics of the distance between a model marker and its marker data
+ * over the frames at which the marker has valid data (in meters). */
+struct MarkerErrorStatistics {
+	MarkerErrorStatistics() :
+		frameCount (0),
+		missingFrameCount (0),
+		mean (0.),
+		standardDeviation (0.),
+		median (0.),
+		percentile95 (0.),
+		max (0.)
+	{}
+
+	std::string markerName;
+	/// number of frames at which the marker has valid data
+	int frameCount;
+	int missingFrameCount;
+	double mean;
+	double standardDeviation;
+	double median;
+	double percentile95;
+	double max;
+};
 
 struct ModelFitter {
 	struct ModelFitterInternal;
+	struct FitContext;
+	struct FittingPlan;
 
 	MarkerData *data;
 	Model *model;
 	ModelFitterInternal *internal;
+	/// markers of the model and their assignment to the marker data
+	FittingPlan *plan;
 
 	double tolerance;
 	bool success;
 	unsigned int steps;
 	unsigned int maxSteps;
 
+	/// Number of worker threads used by computeModelAnimationFromMarkers()
+	/// (1: sequential fit, 0: use all available cores).
+	unsigned int threadCount;
+	/// Number of frames that are fitted in front of each chunk (except the
+	/// first one) to warm start the chunk.
+	unsigned int chunkOverlap;
+	/// Maximum difference of the fitted states at which the fit of a chunk
+	/// and its re-fit from the preceding chunk are considered equal.
+	double chunkTolerance;
+	/// decomposition used to solve the damped normal equations
+	IKLinearSolver linearSolver;
+	/// whether the normal equations are solved in joint or task space
+	IKSystemForm systemForm;
+	/// whether the IK only uses the columns of the Jacobian of each marker
+	/// that belong to the degrees of freedom that move the marker
+	bool sparseJacobian;
+	/// how the initial state of each frame is computed when fitting an
+	/// animation
+	IKWarmStart warmStart;
+	/// If larger than 1 computeModelAnimationFromMarkers() first fits every
+	/// coarseStride-th frame and then refines the frames in between
+	/// starting from a spline interpolation of the fitted frames.
+	unsigned int coarseStride;
+	/// Maximum number of IK steps used to refine a frame between two
+	/// coarse frames. Frames that do not converge are continued with
+	/// maxSteps.
+	unsigned int refineSteps;
+	/// Whether the free-flyer root of the model is initialized in closed
+	/// form from the root markers at the first frame of a fit and after the
+	/// root markers were missing.
+	bool rootInitialization;
+	/// If larger than 1 the IK only computes the exact marker Jacobian at
+	/// every jacobianUpdateInterval-th evaluation (also across frames) and
+	/// uses Broyden updates in between (see IKWorkspace).
+	unsigned int jacobianUpdateInterval;
+	/// format of the log of the fitted frames (FittingLogNone disables it)
+	FittingLogFormat logFormat;
+	/// file of the log (empty: fitting_log.csv or fitting_log.bin)
+	std::string logFilename;
+	FittingLog *fittingLog;
+	/// Directory of the cache of fitted frames (empty: no cache). See
+	/// computeModelAnimationFromMarkers().
+	std::string cacheDirectory;
+	FitCache *fitCache;
+	/// total number of IK steps of the last computeModelAnimationFromMarkers()
+	unsigned int animationSteps;
+	/// number of frames of the last computeModelAnimationFromMarkers() that
+	/// were read from the cache
+	unsigned int animationCachedFrames;
+
 	VectorNd initialState;
 	VectorNd fittedState;
 	VectorNd residuals;
@@ -53,10 +230,129 @@ struct ModelFitter {
 	virtual ~ModelFitter();
 
 	void setup();
-	virtual bool run (const VectorNd &initialState) = 0;
+	bool run (const VectorNd &initialState);
+
+	/** Runs the inverse kinematics on the given RBDL model using the
+	 * initial state and targets stored in the given internal data.
+	 *
+	 * Must not modify the fitter itself so that it can be called from
+	 * multiple threads, each with its own RBDL model and internal data.
+	 * The residuals contain 3 values for each marker of the fitting plan
+	 * (zero for markers that are not fitted).
+	 */
+	virtual bool solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const = 0;
+	/** Name and parameters of the method used by solve(). */
+	virtual std::string getMethodParameters () const = 0;
+
+	/** Hash of the model and of all parameters that influence the fitted
+	 * poses (method, tolerances, IK options, threads and the initial
+	 * state). Has to be called from the thread that owns the model. */
+	uint64_t calcParameterHash (const VectorNd &initialState);
+
+	/** Compiles the fitting plan if the model, its markers or the marker
+	 * data changed since it was last compiled. */
+	void updateFittingPlan ();
+
+	/** Creates the data needed to fit frames independently of
+	 * MarkerData::currentFrame and the model used by the scene.
+	 *
+	 * The context contains a copy of the RBDL model and the assignment of
+	 * the model markers. It has to be created on the thread that owns the
+	 * model, but can afterwards be used on any thread (one context per
+	 * thread).
+	 */
+	FitContext* createFitContext ();
+	void destroyFitContext (FitContext *context) const;
+	/** Prints the markers of the context that have no valid data in the
+	 * given range of frames together with the number of frames they are
+	 * missing. Replaces a warning for each missing marker at each frame.
+	 */
+	void printMissingMarkerSummary (const FitContext *context, int frame_first, int frame_last) const;
+	/** Adds the number of frames in [frame_first, frame_last] at which the
+	 * markers of the context have no valid data to missing_counts (one
+	 * entry per marker of getFitMarkerNames()). */
+	void countMissingMarkers (const FitContext *context, int frame_first, int frame_last, std::vector<int> *missing_counts) const;
+	/** Prints the summary for counts of countMissingMarkers(). */
+	void printMissingMarkerSummary (const FitContext *context, int frame_first, int frame_last, const std::vector<int> &missing_counts) const;
+	/** Fits the frames of the given marker data with the context instead of
+	 * the data of the fitter, e.g. to fit several trials with the same
+	 * model. Does not access the model and can be called from any thread.
+	 */
+	void setFitContextData (FitContext *context, MarkerData *marker_data) const;
+
+	/** Names of the markers that are fitted using the context. Marker
+	 * residuals are packed in this order (3 values per marker). */
+	const std::vector<std::string>& getFitMarkerNames (const FitContext *context) const;
 
+	/** Fits the model to the marker data of the context at the given frame.
+	 *
+	 * Residuals of markers without valid data at this frame are zero.
+	 */
+	bool fitFrame (FitContext *context, int frame, const VectorNd &q_init, VectorNd *q_fitted, VectorNd *marker_residuals, unsigned int *steps) const;
+
+	/** Fits the model to the given marker positions (3 values per marker in
+	 * the order of getFitMarkerNames()).
+	 */
+	bool fitMarkerPositions (FitContext *context, const VectorNd &marker_positions, const VectorNd &q_init, VectorNd *q_fitted, VectorNd *marker_residuals, unsigned int *steps) const;
+
+	std::string getLogFilename () const;
+	/** Opens the log unless append is true and the log is still open from
+	 * fitting the previous frames. */
+	void openLog (const std::vector<std::string> &marker_names, bool append);
+
+	/** Fits the frames in [frame_start, frame_end] with the configured
+	 * method (sequential, parallel or coarse-to-fine) and writes the
+	 * results to fitted_frames[0 .. frame_end - frame_start]. */
+	void fitFrameRange (FitContext *context, const VectorNd &initialState, int frame_start, int frame_end, FittedFrame *fitted_frames);
+	/** Fits the frames in [frame_start, frame_end] like fitFrameRange() but
+	 * in the calling thread (sequential or coarse-to-fine).
+	 *
+	 * If continued is true, initialState is the fitted pose of the frame
+	 * before frame_start. Does not access the model and can be called from
+	 * any thread.
+	 */
+	void fitFrameRangeSequential (FitContext *context, const VectorNd &initialState, bool continued, int frame_start, int frame_end, FittedFrame *fitted_frames) const;
+
+	/** Fits the frames in [frame_start, frame_end] and adds the poses to the
+	 * animation.
+	 *
+	 * If cacheDirectory is set, frames that are found in the cache are not
+	 * fitted again. The fit continues after the last cached frame
+	 * starting from its pose and the new frames are added to the cache
+	 * every FIT_CACHE_BLOCK_FRAMES frames so that a canceled or crashed
+	 * fit can be resumed.
+	 */
 	bool computeModelAnimationFromMarkers (const VectorNd &initialState, Animation *animation, int frame_start = -1, int frame_end = -1);
-	void analyzeAnimation (Animation animation);
+	/** Fits all frames of marker data that was opened with
+	 * MarkerData::openFile() in windows of window_size frames and writes
+	 * the poses to the animation file after each window.
+	 *
+	 * Only the current window of the marker data and of the fitted frames
+	 * is kept in memory, so the memory usage does not depend on the length
+	 * of the recording. The cache is not used.
+	 */
+	bool streamModelAnimationFromMarkers (const VectorNd &initialState, int window_size, const char *animation_filename);
+	/** Collects the frames of the marker data at which at least one of the
+	 * given markers of the fitting plan has valid data, i.e. the frames
+	 * whose fit depends on the coordinates of these markers.
+	 */
+	void getMarkerFrames (const std::vector<std::string> &marker_names, std::vector<int> *frames);
+	/** Re-fits the given frames of an animation that contains a pose for
+	 * each frame of the marker data (e.g. after model markers were edited).
+	 *
+	 * Each frame starts from its pose in the animation which is replaced by
+	 * the new fit. The frames are fitted independently using threadCount
+	 * threads and are not written to the log. Returns false without fitting
+	 * if the animation does not contain a pose for each frame.
+	 */
+	bool refitAnimationFrames (Animation *animation, const std::vector<int> &frames);
+	/** Computes the distances between the model markers in the poses of the
+	 * animation and the marker data at all frames using threadCount
+	 * threads. The distances are written to the log and, if statistics is
+	 * not NULL, their statistics for each marker of the fitting plan are
+	 * returned.
+	 */
+	void analyzeAnimation (const Animation &animation, std::vector<MarkerErrorStatistics> *statistics = NULL);
 
 	VectorNd getFittedState() {
 		return fittedState;
@@ -68,7 +364,8 @@ struct SugiharaFitter : public ModelFitter {
 		ModelFitter (model, data, maxSteps) 
 	{}
 	virtual ~SugiharaFitter() {};
-	virtual bool run (const VectorNd &initialState);
+	virtual bool solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const;
+	virtual std::string getMethodParameters () const;
 };
 
 struct SugiharaTaskSpaceFitter : public ModelFitter {
@@ -76,7 +373,8 @@ struct SugiharaTaskSpaceFitter : public ModelFitter {
 		ModelFitter (model, data, maxSteps) 
 	{}
 	virtual ~SugiharaTaskSpaceFitter() {};
-	virtual bool run (const VectorNd &initialState);
+	virtual bool solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const;
+	virtual std::string getMethodParameters () const;
 };
 
 struct LevenbergMarquardtFitter : public ModelFitter {
@@ -85,10 +383,32 @@ struct LevenbergMarquardtFitter : public ModelFitter {
 		lambda (lambda)
 	{}
 	virtual ~LevenbergMarquardtFitter() {};
-	virtual bool run (const VectorNd &initialState);
+	virtual bool solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const;
+	virtual std::string getMethodParameters () const;
 
 	double lambda;
 };
 
+/** Levenberg Marquardt fitter that rejects steps which increase the error
+ * and adapts the damping after each step (see
+ * AdaptiveLevenbergMarquardtIK()). maxSteps is the iteration budget per
+ * frame including rejected steps.
+ */
+struct AdaptiveLevenbergMarquardtFitter : public ModelFitter {
+	AdaptiveLevenbergMarquardtFitter (Model *model, MarkerData *data, unsigned int maxSteps = 200, double gradientTolerance = 1.0e-10, double dampingScale = 1.0e-3):
+		ModelFitter (model, data, maxSteps),
+		gradientTolerance (gradientTolerance),
+		dampingScale (dampingScale)
+	{}
+	virtual ~AdaptiveLevenbergMarquardtFitter() {};
+	virtual bool solve (RigidBodyDynamics::Model &rbdl_model, ModelFitterInternal *fit_data, unsigned int *steps, VectorNd *residuals) const;
+	virtual std::string getMethodParameters () const;
+
+	/// converged if the largest element of J^T e is below this value
+	double gradientTolerance;
+	/// initial damping relative to the largest diagonal element of J^T J
+	double dampingScale;
+};
+
 /* MODEL_FITTER_H */
 #endif 
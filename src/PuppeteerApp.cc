@@ -53,6 +53,7 @@
 #include <iomanip>
 #include <cstdlib>
 #include <fstream>
+#include <algorithm>
 
 using namespace std;
 
@@ -90,6 +91,10 @@ PuppeteerApp::PuppeteerApp(QWidget *parent)
 	markerData = NULL;
 	modelFitter = NULL;
 	animationData = NULL;
+	fitThreadCount = 1;
+	useMarkerCache = false;
+	animationFitComplete = false;
+	animationFitRevision = 0;
 	activeModelFrame = 0;
 	activeObject = -1;
 
@@ -270,15 +275,27 @@ bool PuppeteerApp::parseArgs(int argc, char* argv[]) {
 
 		TCLAP::ValueArg<string> scripting_file_arg ("s", "script", "scripting file", false, "", "");
 
+		TCLAP::ValueArg<unsigned int> fit_threads_arg ("j", "threads", "number of threads used to fit the animation (0: all cores)", false, 1, "count");
+
+		TCLAP::ValueArg<string> fit_cache_arg ("", "fit-cache", "directory of the cache of fitted frames", false, "", "dir");
+
+		TCLAP::SwitchArg marker_cache_Swi("", "marker-cache", "read and write decoded marker data in a cache file next to the motion capture data", false);
+
 		// than we may add the command line option to the command line parser
 		cmd.add( files_Arg );
 		cmd.add( rotateMoCap_Swi );
 		cmd.add( scripting_file_arg );
+		cmd.add( fit_threads_arg );
+		cmd.add( fit_cache_arg );
+		cmd.add( marker_cache_Swi );
 
 		// then we do parse the command line
 		cmd.parse(argc, argv);
 
 		scripting_file = scripting_file_arg.getValue();
+		fitThreadCount = fit_threads_arg.getValue();
+		fitCacheDirectory = fit_cache_arg.getValue();
+		useMarkerCache = marker_cache_Swi.getValue();
 
 		vector<string> files = files_Arg.getValue();
 		for (vector<string>::iterator filePtr = files.begin(); filePtr != files.end(); filePtr++) {
@@ -354,6 +371,7 @@ bool PuppeteerApp::loadModelFile (const char* filename) {
 
 	bool result = markerModel->loadFromFile (filename);
 	markerModel->fileName = filename;
+	animationFitComplete = false;
 	buildModelStateEditor();
 	updateModelStateEditor();
 
@@ -367,6 +385,8 @@ bool PuppeteerApp::loadMocapFile (const char* filename, const bool rotateZ) {
 		delete markerData;
 	markerData = new MarkerData (scene);
 	assert (markerData);
+	markerData->useMarkerCache = useMarkerCache;
+	animationFitComplete = false;
 
 	for (int i=0;i<markerModel->modelMarkers.size();i++)
 		markerData->markerNames.push_back(markerModel->modelMarkers[i]->markerName);
@@ -375,25 +395,9 @@ bool PuppeteerApp::loadMocapFile (const char* filename, const bool rotateZ) {
 		return false;
 
 	// check whether we want to rotate the data
-	if (markerData->markerExists ("LASI") && markerData->markerExists ("LPSI")) {
-
-		float fraction_negative = 0.f;
-		int frame_count = markerData->getLastFrame() - markerData->getFirstFrame();
-
-		for (int i = markerData->getFirstFrame(); i < markerData->getLastFrame(); i++) {
-			markerData->setCurrentFrameNumber (i);
-			Vector3f lasi = markerData->getMarkerCurrentPosition("LASI");
-			Vector3f lpsi = markerData->getMarkerCurrentPosition("LPSI");
-
-			float projection = (lasi - lpsi).normalize().dot(Vector3f (1.f, 0.f, 0.f));
-
-			if (projection < -0.)
-				fraction_negative = fraction_negative + 1.f / static_cast<float>(frame_count);
-		}
-
-		// reset current frame
-		markerData->setCurrentFrameNumber (markerData->getFirstFrame());
+	float fraction_negative = markerData->getBackwardsFrameFraction();
 
+	if (fraction_negative >= 0.f) {
 		if (fraction_negative > 0.5) {
 			QMessageBox rotate_message_box;
 			rotate_message_box.setText("Backwards orientation detected.");
@@ -433,6 +437,7 @@ bool PuppeteerApp::loadAnimationFile (const char* filename) {
 	
 	animationData = new Animation();
 	assert (animationData);
+	animationFitComplete = false;
 
 	if(!animationData->loadFromFile (filename))
 		return false;
@@ -653,7 +658,13 @@ void PuppeteerApp::assignMarkers() {
 
 	Vector3f marker_position, local_coords;
 	for (unsigned int i = 0; i < marker_names.size(); i++) {
-		marker_position = markerData->getMarkerCurrentPosition(marker_names[i].c_str());
+		int marker_index = markerData->getMarkerIndex (marker_names[i].c_str());
+		if (marker_index < 0) {
+			cerr << "Warning: marker " << marker_names[i] << " does not exist" << endl;
+			continue;
+		}
+
+		marker_position = markerData->getMarkerPosition (marker_index, markerData->currentFrame);
 		local_coords = markerModel->calcMarkerLocalCoords(frame_ids[i], marker_position);
 		markerModel->setFrameMarkerCoord (frame_ids[i],marker_names[i].c_str(),local_coords);
 	}
@@ -815,34 +826,91 @@ void PuppeteerApp::fitAnimation() {
 	if (!animationData)
 		animationData = new Animation();
 
-	animationData->keyFrames.clear();
-	int frame_count = markerData->getLastFrame() - markerData->getFirstFrame();
-
-	QProgressDialog progress ("Computing Animation...", "Cancel", 0, frame_count, this);
-	progress.setWindowModality (Qt::WindowModal);
-	progress.setMinimumDuration (0);
+	// When fitting with multiple threads we pass blocks of frames to the
+	// fitter so that the progress dialog still gets updated.
+	modelFitter->threadCount = fitThreadCount;
+	modelFitter->cacheDirectory = fitCacheDirectory;
+	int block_size = 1;
+	if (fitThreadCount != 1)
+		block_size = 1000;
 
 	bool success = true;
+	bool canceled = false;
 	int i = 0;
+	int frame_count = markerData->getLastFrame() - markerData->getFirstFrame();
+	unsigned int fit_revision = markerModel->revision;
+
+	// If only model markers were edited since the last complete fit we
+	// only re-fit the frames at which the edited markers have data and
+	// start from the previously fitted poses. Otherwise (or if the
+	// animation no longer has a pose for each frame, e.g. because it was
+	// loaded from a file) all frames are fitted.
+	std::vector<std::string> edited_markers;
+	bool refit_possible = animationFitComplete
+		&& animationData->keyFrames.size() == static_cast<size_t>(frame_count + 1)
+		&& markerModel->getEditedMarkers (animationFitRevision, &edited_markers);
+	if (refit_possible) {
+		std::vector<int> refit_frames;
+		modelFitter->getMarkerFrames (edited_markers, &refit_frames);
+		int refit_count = static_cast<int>(refit_frames.size());
+		qDebug() << "re-fitting" << refit_count << "of" << frame_count + 1 << "frames";
+
+		if (refit_count > 0) {
+			QProgressDialog progress (QString ("Re-fitting %1 of %2 frames...").arg(refit_count).arg(frame_count + 1), "Cancel", 0, refit_count, this);
+			progress.setWindowModality (Qt::WindowModal);
+			progress.setMinimumDuration (0);
+
+			std::vector<int> block_frames;
+			for (i = 0; i < refit_count; i += block_size) {
+				progress.setValue(i);
+
+				block_frames.assign (refit_frames.begin() + i, refit_frames.begin() + std::min (i + block_size, refit_count));
+				bool fit_result = modelFitter->refitAnimationFrames (animationData, block_frames);
+
+				if (progress.wasCanceled()) {
+					qDebug() << "canceled!";
+					canceled = true;
+					break;
+				}
 
-	for (i = 0; i <= frame_count; i++) {
-		progress.setValue(i);
-		
-		bool fit_result = modelFitter->computeModelAnimationFromMarkers (markerModel->modelStateQ, animationData, markerData->getFirstFrame() + i, markerData->getFirstFrame() + i);
+				if (!fit_result)
+					success = false;
+			}
+
+			progress.setValue (refit_count);
+		}
+	} else {
+		animationData->keyFrames.clear();
+
+		QProgressDialog progress ("Computing Animation...", "Cancel", 0, frame_count, this);
+		progress.setWindowModality (Qt::WindowModal);
+		progress.setMinimumDuration (0);
 
-		if (progress.wasCanceled()) {
-			qDebug() << "canceled!";
-			success = false;
-			break;
+		for (i = 0; i <= frame_count; i += block_size) {
+			progress.setValue(i);
+
+			bool fit_result = modelFitter->computeModelAnimationFromMarkers (markerModel->modelStateQ, animationData, markerData->getFirstFrame() + i, markerData->getFirstFrame() + std::min (i + block_size - 1, frame_count));
+
+			if (progress.wasCanceled()) {
+				qDebug() << "canceled!";
+				canceled = true;
+				break;
+			}
+
+			if (!fit_result)
+				success = false;
 		}
 
-		if (!fit_result)
-			success = false;
+		progress.setValue (std::min (i, frame_count));
+
+		animationFitComplete = !canceled;
 	}
 
-	progress.setValue (i);
+	// a canceled re-fit is repeated for all edited markers the next time
+	if (!canceled)
+		animationFitRevision = fit_revision;
 
-	if (success) {
+	if (success && !canceled) {
 		qDebug() << "fit successful!";
 	} else {
 		qDebug() << "fit failed!";
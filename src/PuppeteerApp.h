@@ -67,6 +67,18 @@ public:
 		MarkerData *markerData;
 		ModelFitter *modelFitter;
 		Animation *animationData;
+		/// number of threads used by fitAnimation() (0: all cores)
+		unsigned int fitThreadCount;
+		/// directory of the cache of fitted frames (empty: no cache)
+		std::string fitCacheDirectory;
+		/// whether marker data is read from and written to the marker cache
+		/// next to the marker data file
+		bool useMarkerCache;
+		/// whether animationData contains a fit of all frames of markerData
+		/// with the model at animationFitRevision
+		bool animationFitComplete;
+		/// Model::revision of the model used for the last fit of animationData
+		unsigned int animationFitRevision;
 
 		PuppeteerAboutDialog *aboutDialog;
 
@@ -366,9 +366,28 @@ static int mocap_data_clearMarkers (lua_State *L) {
 	return 0;
 }
 
+/** Returns the id of the marker that is given at the stack index either
+ * as id (see mocap_data.getMarkerId) or as name. */
+int l_checkmarkerid (lua_State *L, MarkerData *marker_data, int index) {
+	if (lua_type (L, index) == LUA_TNUMBER) {
+		int marker_index = luaL_checkinteger (L, index);
+		if (marker_index < 0 || marker_index >= marker_data->getMarkerCount())
+			luaL_error (L, "Invalid marker id %d!", marker_index);
+
+		return marker_index;
+	}
+
+	const char* marker_name = luaL_checkstring (L, index);
+	int marker_index = marker_data->getMarkerIndex (marker_name);
+	if (marker_index < 0)
+		luaL_error (L, "Could not find marker '%s'!", marker_name);
+
+	return marker_index;
+}
+
 ///
 // @function puppeteer.mocap_data.enableMarker
-// @param marker_name
+// @param marker_name or marker id
 // @param color
 static int mocap_data_enableMarker (lua_State *L) {
 	MarkerData* marker_data = app_ptr->markerData;
@@ -376,17 +395,40 @@ static int mocap_data_enableMarker (lua_State *L) {
 	if (!marker_data)
 		luaL_error (L, "No motion capture file loaded!");
 
-	string marker_name = luaL_checkstring (L, 1);
 	Vector3f color = l_checkvector3f (L, 2);
 
-	marker_data->enableMarker (marker_name.c_str(), color);
+	if (lua_type (L, 1) == LUA_TNUMBER)
+		marker_data->enableMarker (l_checkmarkerid (L, marker_data, 1), color);
+	else
+		marker_data->enableMarker (luaL_checkstring (L, 1), color);
 
 	return 0;
 }
 
+/// Resolves a marker name to the id that can be passed to the other
+/// mocap_data functions instead of the name to avoid looking up the name
+/// on every call.
+// @function puppeteer.mocap_data.getMarkerId
+// @param marker_name
+// @return marker id or nil if there is no such marker
+static int mocap_data_getMarkerId (lua_State *L) {
+	MarkerData* marker_data = app_ptr->markerData;
+
+	if (!marker_data)
+		luaL_error (L, "No motion capture file loaded!");
+
+	int marker_index = marker_data->getMarkerIndex (luaL_checkstring (L, 1));
+	if (marker_index < 0)
+		lua_pushnil (L);
+	else
+		lua_pushnumber (L, static_cast<double>(marker_index));
+
+	return 1;
+}
+
 ///
 // @function puppeteer.mocap_data.getMarkerPosition
-// @param marker_name
+// @param marker_name or marker id
 // @return current marker position 
 static int mocap_data_getMarkerCurrentPosition (lua_State *L) {
 	MarkerData* marker_data = app_ptr->markerData;
@@ -394,8 +436,7 @@ static int mocap_data_getMarkerCurrentPosition (lua_State *L) {
 	if (!marker_data)
 		luaL_error (L, "No motion capture file loaded!");
 
-	const char* marker_name = luaL_checkstring (L, 1);
-	Vector3f position = marker_data->getMarkerCurrentPosition (marker_name);
+	Vector3f position = marker_data->getMarkerCurrentPosition (l_checkmarkerid (L, marker_data, 1));
 
 	l_pushvector3f (L, position);
 
@@ -409,6 +450,7 @@ static const struct luaL_Reg puppeteer_mocap_data_f[] = {
 	{ "calcDataBoundingBox", mocap_data_calcDataBoundingBox},
 	{ "clearMarkers", mocap_data_clearMarkers},
 	{ "enableMarker", mocap_data_enableMarker},
+	{ "getMarkerId", mocap_data_getMarkerId},
 	{ "getMarkerCurrentPosition", mocap_data_getMarkerCurrentPosition},
 	{ NULL, NULL}
 };
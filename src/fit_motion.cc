@@ -24,7 +24,12 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
 
 #include "timer.h"
 
@@ -32,6 +37,7 @@
 #include "MarkerData.h"
 #include "Animation.h"
 #include "ModelFitter.h"
+#include "FitCache.h"
 
 /* workaround when using ubuntu versions (e.g. 14.04) that are affected by
  * https://bugs.launchpad.net/ubuntu/+source/nvidia-graphics-drivers-319/+bug/1248642
@@ -53,13 +59,120 @@ ModelFitter *fitter = NULL;
 string fitter_method = "sugihara";
 bool analyze_mode = false;
 unsigned int max_steps = 100;
+unsigned int thread_count = 1;
+IKLinearSolver linear_solver = IKSolverLLT;
+IKSystemForm system_form = IKSystemAuto;
+bool sparse_jacobian = true;
+IKWarmStart warm_start = IKWarmStartPrevious;
+bool benchmark_mode = false;
+unsigned int coarse_stride = 1;
+unsigned int refine_steps = 10;
+bool compare_sequential = false;
+bool root_initialization = false;
+unsigned int jacobian_update_interval = 1;
+FittingLogFormat log_format = FittingLogCSV;
+bool compare_fitters_mode = false;
+/// marker data files given on the command line or in the batch manifest
+vector<string> trial_files;
+bool batch_mode = false;
+string output_dir = ".";
+/// directory of the cache of fitted frames (empty: no cache)
+string cache_dir = "";
+/// number of frames that are decoded and fitted at once when streaming
+/// the marker data (0: load all frames)
+int stream_frames = 0;
+/// whether the marker data is read from and written to the marker cache
+/// next to each marker data file
+bool use_marker_cache = false;
 
 void print_usage(const char* execname) {
-	cout << "Usage: " << execname << " <modelfile.lua> <mocapdata.c3d> [motion.csv] [--levenberg] [-s count]" << endl;
-	cout << "-s count    : sets the maximum number of IK steps to count (default 200)." << endl;
+	cout << "Usage: " << execname << " <modelfile.lua> <mocapdata.c3d> [motion.csv] [--levenberg|--sugiharats|--adaptive] [-s count] [-j count] [--solver name] [--system form] [--dense] [--warm-start method] [--root-init] [--broyden interval] [--coarse stride] [--refine-steps count] [--compare] [--log format] [--cache dir] [--marker-cache] [--stream frames] [--benchmark] [--compare-fitters]" << endl;
+	cout << "       " << execname << " <modelfile.lua> <mocapdata.c3d> <mocapdata.c3d> ... [--batch manifest.txt] [--output-dir dir] [options]" << endl;
+	cout << "--levenberg    : uses Levenberg Marquardt with constant damping." << endl;
+	cout << "--sugiharats   : uses Sugihara's method with damping of each residual." << endl;
+	cout << "--adaptive     : uses Levenberg Marquardt with adaptive damping." << endl;
+	cout << "-s count       : sets the maximum number of IK steps to count (default 200)." << endl;
+	cout << "-j count       : fits the frames using count threads (default 1, 0 uses all cores)." << endl;
+	cout << "--solver name  : decomposition for the IK normal equations: llt (default), ldlt or qr." << endl;
+	cout << "--system form  : solves the IK normal equations in joint or task space or" << endl
+		<< "                 auto (default) to use the smaller one." << endl;
+	cout << "--dense        : uses the full Jacobian instead of only the columns of the" << endl
+		<< "                 degrees of freedom that move each marker." << endl;
+	cout << "--warm-start method" << endl
+		<< "               : initial state of the IK of each frame: previous (default) for the" << endl
+		<< "                 previous fitted state, velocity or acceleration for an" << endl
+		<< "                 extrapolation of the previous states or kalman for the" << endl
+		<< "                 prediction of a Kalman filter." << endl;
+	cout << "--root-init    : computes the root pose from the root markers at the first" << endl
+		<< "                 frame and after gaps of the root markers." << endl;
+	cout << "--broyden interval" << endl
+		<< "               : computes the exact marker Jacobian only at every interval-th" << endl
+		<< "                 IK step (also across frames) and uses Broyden updates in" << endl
+		<< "                 between (default 1: always exact)." << endl;
+	cout << "--coarse stride: first fits every stride-th frame and then refines the frames" << endl
+		<< "                 in between starting from a spline interpolation." << endl;
+	cout << "--refine-steps count" << endl
+		<< "               : maximum number of IK steps to refine frames between coarse" << endl
+		<< "                 frames before using the full number of steps (default 10)." << endl;
+	cout << "--compare      : also performs a sequential fit of all frames and prints the" << endl
+		<< "                 difference of the fitted states." << endl;
+	cout << "--log format   : format of the fitting log, one of csv (default), binary" << endl
+		<< "                 (fitting_log.bin) or none." << endl;
+	cout << "--cache dir    : stores the fitted frames in the cache directory dir and reuses" << endl
+		<< "                 them when the model, the marker data and all fitting options" << endl
+		<< "                 are unchanged. Canceled fits are resumed after the last" << endl
+		<< "                 cached frame." << endl;
+	cout << "--marker-cache : reads the decoded marker data from a cache file next to each" << endl
+		<< "                 marker data file (<file>.mcache) and writes it if it is" << endl
+		<< "                 missing or the marker data file has changed. Not used" << endl
+		<< "                 with --stream." << endl;
+	cout << "--stream frames: decodes and fits the marker data in windows of the given" << endl
+		<< "                 number of frames and writes animation.csv after each window" << endl
+		<< "                 so that the memory usage does not depend on the length of" << endl
+		<< "                 the recording. Not used with --cache, --compare or the" << endl
+		<< "                 batch, benchmark and analysis modes." << endl;
+	cout << "--benchmark    : fits all frames with each solver, system form and Jacobian" << endl
+		<< "                 layout and prints the timings." << endl;
+	cout << "--compare-fitters" << endl
+		<< "               : fits all frames with each fitter and prints the number of" << endl
+		<< "                 converged frames, IK steps and residuals." << endl;
+	cout << "--batch manifest.txt" << endl
+		<< "               : fits all marker data files listed in the manifest (one file" << endl
+		<< "                 per line, lines starting with # are ignored). Batch mode is" << endl
+		<< "                 also used when multiple marker data files are given." << endl;
+	cout << "--output-dir dir" << endl
+		<< "               : existing directory for the results of a batch fit (default" << endl
+		<< "                 is the current directory)." << endl;
+	cout << "" << endl;
+	cout << "In batch mode the model is loaded once and the trials are fitted" << endl
+		<< "concurrently by -j count threads (each trial sequentially). For each trial" << endl
+		<< "<name>.c3d the animation is saved to <dir>/<name>.csv and the fitting log to" << endl
+		<< "<dir>/<name>_fitting_log.csv (or .bin). A summary of all trials is saved to" << endl
+		<< "<dir>/batch_summary.csv." << endl;
 	cout << "" << endl;
 	cout << "Note: when specifying motion file no inverse kinematics is performed. Instead it" << endl
-		<< "analyzes the the motion file and saves the result to the file fitting_log.csv" << endl;
+		<< "analyzes the the motion file using -j count threads, prints the statistics of the" << endl
+		<< "marker errors and saves the errors to the file fitting_log.csv (or fitting_log.bin)." << endl;
+}
+
+/** Adds the marker data files listed in the manifest to trial_files. */
+bool read_manifest (const char* filename) {
+	ifstream manifest (filename);
+	if (!manifest) {
+		cerr << "Error: cannot open batch manifest " << filename << endl;
+		return false;
+	}
+
+	string line;
+	while (getline (manifest, line)) {
+		line = line.substr (0, line.find_last_not_of (" \t\r") + 1);
+		if (line.size() == 0 || line[0] == '#')
+			continue;
+
+		trial_files.push_back (line);
+	}
+
+	return true;
 }
 
 bool parse_args (int argc, char* argv[]) {
@@ -73,14 +186,134 @@ bool parse_args (int argc, char* argv[]) {
 			}
 			i++;
 			continue;
+		} else if ((arg == "-j") && (argc > i + 1)) {
+			istringstream convert (argv[i + 1]);
+			if (!(convert >> thread_count)) {
+				cerr << "Error: cannot parse number argument of -j: " << argv[i+1] << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--solver") && (argc > i + 1)) {
+			string name (argv[i + 1]);
+			if (name == "llt") {
+				linear_solver = IKSolverLLT;
+			} else if (name == "ldlt") {
+				linear_solver = IKSolverLDLT;
+			} else if (name == "qr") {
+				linear_solver = IKSolverQR;
+			} else {
+				cerr << "Error: unknown solver " << name << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--system") && (argc > i + 1)) {
+			string name (argv[i + 1]);
+			if (name == "auto") {
+				system_form = IKSystemAuto;
+			} else if (name == "joint") {
+				system_form = IKSystemJointSpace;
+			} else if (name == "task") {
+				system_form = IKSystemTaskSpace;
+			} else {
+				cerr << "Error: unknown system form " << name << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--warm-start") && (argc > i + 1)) {
+			string name (argv[i + 1]);
+			if (name == "previous") {
+				warm_start = IKWarmStartPrevious;
+			} else if (name == "velocity") {
+				warm_start = IKWarmStartVelocity;
+			} else if (name == "acceleration") {
+				warm_start = IKWarmStartAcceleration;
+			} else if (name == "kalman") {
+				warm_start = IKWarmStartKalman;
+			} else {
+				cerr << "Error: unknown warm start method " << name << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--coarse") && (argc > i + 1)) {
+			istringstream convert (argv[i + 1]);
+			if (!(convert >> coarse_stride) || coarse_stride == 0) {
+				cerr << "Error: cannot parse number argument of --coarse: " << argv[i+1] << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--refine-steps") && (argc > i + 1)) {
+			istringstream convert (argv[i + 1]);
+			if (!(convert >> refine_steps)) {
+				cerr << "Error: cannot parse number argument of --refine-steps: " << argv[i+1] << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--broyden") && (argc > i + 1)) {
+			istringstream convert (argv[i + 1]);
+			if (!(convert >> jacobian_update_interval) || jacobian_update_interval == 0) {
+				cerr << "Error: cannot parse number argument of --broyden: " << argv[i+1] << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if (arg == "--root-init") {
+			root_initialization = true;
+		} else if ((arg == "--log") && (argc > i + 1)) {
+			string name (argv[i + 1]);
+			if (name == "csv") {
+				log_format = FittingLogCSV;
+			} else if (name == "binary") {
+				log_format = FittingLogBinary;
+			} else if (name == "none") {
+				log_format = FittingLogNone;
+			} else {
+				cerr << "Error: unknown log format " << name << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--batch") && (argc > i + 1)) {
+			if (!read_manifest (argv[i + 1]))
+				return false;
+			batch_mode = true;
+			i++;
+			continue;
+		} else if ((arg == "--cache") && (argc > i + 1)) {
+			cache_dir = argv[i + 1];
+			i++;
+			continue;
+		} else if (arg == "--marker-cache") {
+			use_marker_cache = true;
+		} else if ((arg == "--stream") && (argc > i + 1)) {
+			istringstream convert (argv[i + 1]);
+			if (!(convert >> stream_frames) || stream_frames <= 0) {
+				cerr << "Error: cannot parse number argument of --stream: " << argv[i+1] << endl;
+				return false;
+			}
+			i++;
+			continue;
+		} else if ((arg == "--output-dir") && (argc > i + 1)) {
+			output_dir = argv[i + 1];
+			i++;
+			continue;
+		} else if (arg == "--compare") {
+			compare_sequential = true;
+		} else if (arg == "--dense") {
+			sparse_jacobian = false;
+		} else if (arg == "--benchmark") {
+			benchmark_mode = true;
 		} else if (arg.substr(arg.size() - 4, 4) == ".lua") {
 			model = new Model();
 			if (!model->loadFromFile (arg.c_str()))
 				return false;
 		} else if (arg.substr(arg.size() - 4, 4) == ".c3d") {
-			data = new MarkerData();
-			if(!data->loadFromFile (arg.c_str())) 
-				return false;
+			trial_files.push_back (arg);
 		} else if (arg.substr(arg.size() - 4, 4) == ".csv") {
 			analyze_mode = true;
 			animation = new Animation();
@@ -89,6 +322,10 @@ bool parse_args (int argc, char* argv[]) {
 			fitter_method = "levenberg";
 		} else if (arg == "--sugiharats") {
 			fitter_method = "sugiharats";
+		} else if (arg == "--adaptive") {
+			fitter_method = "adaptive";
+		} else if (arg == "--compare-fitters") {
+			compare_fitters_mode = true;
 		} else {
 			return false;
 		}
@@ -97,22 +334,500 @@ bool parse_args (int argc, char* argv[]) {
 	return true;
 }
 
+/** Creates the fitter of the given method with the options of the
+ * command line. */
+ModelFitter* create_fitter (const string &method) {
+	ModelFitter *result = NULL;
+
+	if (method == "sugihara") {
+		result = new SugiharaFitter(model, data, max_steps);
+	} else if (method == "sugiharats") {
+		result = new SugiharaTaskSpaceFitter(model, data, max_steps);
+	} else if (method == "adaptive") {
+		result = new AdaptiveLevenbergMarquardtFitter (model, data, max_steps);
+	} else {
+		result = new LevenbergMarquardtFitter (model, data, max_steps);
+	}
+	result->threadCount = thread_count;
+	result->linearSolver = linear_solver;
+	result->systemForm = system_form;
+	result->sparseJacobian = sparse_jacobian;
+	result->warmStart = warm_start;
+	result->refineSteps = refine_steps;
+	result->rootInitialization = root_initialization;
+	result->jacobianUpdateInterval = jacobian_update_interval;
+	result->logFormat = log_format;
+	result->cacheDirectory = cache_dir;
+
+	return result;
+}
+
+/** Fits all frames sequentially with each fitter and prints the
+ * convergence statistics. */
+void run_fitter_comparison () {
+	const char* methods[] = { "sugihara", "sugiharats", "levenberg", "adaptive" };
+
+	int frame_count = data->getLastFrame() - data->getFirstFrame() + 1;
+
+	cout << "fitter, converged frames, frames, steps, max steps, mean rms residual, max rms residual, duration [s]" << endl;
+
+	for (size_t mi = 0; mi < 4; mi++) {
+		ModelFitter *method_fitter = create_fitter (methods[mi]);
+		ModelFitter::FitContext *context = method_fitter->createFitContext();
+		FitStatePredictor predictor (method_fitter->warmStart);
+		predictor.reset (model->modelStateQ);
+		VectorNd q;
+		VectorNd q_fitted;
+		VectorNd residuals;
+		unsigned int steps = 0;
+		unsigned int total_steps = 0;
+		unsigned int max_frame_steps = 0;
+		int converged_frames = 0;
+		double rms_sum = 0.;
+		double rms_max = 0.;
+
+		TimerInfo timer;
+		timer_start (&timer);
+
+		for (int frame = data->getFirstFrame(); frame <= data->getLastFrame(); frame++) {
+			predictor.predict (&q);
+			if (method_fitter->fitFrame (context, frame, q, &q_fitted, &residuals, &steps))
+				converged_frames++;
+			predictor.update (q_fitted);
+
+			total_steps += steps;
+			max_frame_steps = std::max (max_frame_steps, steps);
+
+			double rms = 0.;
+			if (residuals.size() > 0)
+				rms = residuals.norm() / sqrt (static_cast<double>(residuals.size() / 3));
+			rms_sum += rms;
+			rms_max = std::max (rms_max, rms);
+		}
+
+		double duration = timer_stop (&timer);
+		method_fitter->destroyFitContext (context);
+		delete method_fitter;
+
+		cout << methods[mi] << ", "
+			<< converged_frames << ", "
+			<< frame_count << ", "
+			<< total_steps << ", "
+			<< max_frame_steps << ", "
+			<< rms_sum / frame_count << ", "
+			<< rms_max << ", "
+			<< duration << endl;
+	}
+}
+
+/** Fits all frames sequentially with each combination of linear solver,
+ * system form and Jacobian layout and prints the duration per frame and
+ * per IK step. */
+void run_benchmark () {
+	IKLinearSolver solvers[] = { IKSolverQR, IKSolverLLT, IKSolverLDLT };
+	const char* solver_names[] = { "qr", "llt", "ldlt" };
+	IKSystemForm forms[] = { IKSystemJointSpace, IKSystemTaskSpace };
+	const char* form_names[] = { "joint", "task" };
+
+	int frame_count = data->getLastFrame() - data->getFirstFrame() + 1;
+
+	cout << "solver, system, jacobian, steps, duration [s], per frame [ms], per step [us]" << endl;
+
+	for (size_t si = 0; si < 3; si++) {
+		for (size_t fi = 0; fi < 2; fi++) {
+			for (int sparse = 1; sparse >= 0; sparse--) {
+				fitter->linearSolver = solvers[si];
+				fitter->systemForm = forms[fi];
+				fitter->sparseJacobian = (sparse == 1);
+
+				ModelFitter::FitContext *context = fitter->createFitContext();
+				FitStatePredictor predictor (fitter->warmStart);
+				predictor.reset (model->modelStateQ);
+				VectorNd q;
+				VectorNd q_fitted;
+				VectorNd residuals;
+				unsigned int steps = 0;
+				unsigned int total_steps = 0;
+
+				TimerInfo timer;
+				timer_start (&timer);
+
+				for (int frame = data->getFirstFrame(); frame <= data->getLastFrame(); frame++) {
+					predictor.predict (&q);
+					fitter->fitFrame (context, frame, q, &q_fitted, &residuals, &steps);
+					total_steps += steps;
+					predictor.update (q_fitted);
+				}
+
+				double duration = timer_stop (&timer);
+				fitter->destroyFitContext (context);
+
+				cout << solver_names[si] << ", " << form_names[fi] << ", "
+					<< (sparse ? "sparse" : "dense") << ", "
+					<< total_steps << ", "
+					<< duration << ", "
+					<< duration * 1.0e3 / frame_count << ", "
+					<< duration * 1.0e6 / std::max (total_steps, 1u) << endl;
+			}
+		}
+	}
+}
+
+/** Result of the fit of a single trial in batch mode. */
+struct BatchTrial {
+	BatchTrial() :
+		frame_count (0),
+		converged_frames (0),
+		cached_frames (0),
+		steps (0),
+		max_frame_steps (0),
+		rms_mean (0.),
+		rms_max (0.),
+		load_duration (0.),
+		fit_duration (0.),
+		failed (false)
+	{}
+
+	string filename;
+	/// output path without extension
+	string output_name;
+	int frame_count;
+	int converged_frames;
+	/// frames that were read from the cache
+	int cached_frames;
+	unsigned int steps;
+	unsigned int max_frame_steps;
+	double rms_mean;
+	double rms_max;
+	double load_duration;
+	double fit_duration;
+	/// whether the trial could not be loaded
+	bool failed;
+};
+
+/** Data shared by all worker threads of a batch fit. */
+struct BatchJob {
+	const ModelFitter *fitter;
+	VectorNd initial_state;
+	/// hash of the model and fitting parameters for the cache keys
+	uint64_t parameter_hash;
+	std::vector<BatchTrial> trials;
+	std::atomic<size_t> next_trial;
+};
+
+/** Loads and fits trials until all trials of the job are taken. Each trial
+ * is fitted in the worker thread with ModelFitter::fitFrameRangeSequential()
+ * and its animation and fitting log are saved. Trials that cannot be loaded
+ * are marked as failed. */
+void fit_trials_worker (BatchJob *job, ModelFitter::FitContext *context) {
+	const ModelFitter &batch_fitter = *(job->fitter);
+	const std::vector<std::string> &marker_names = batch_fitter.getFitMarkerNames (context);
+
+	for (size_t ti = job->next_trial++; ti < job->trials.size(); ti = job->next_trial++) {
+		BatchTrial &trial = job->trials[ti];
+		TimerInfo timer;
+
+		timer_start (&timer);
+		MarkerData trial_data;
+		trial_data.useMarkerCache = use_marker_cache;
+		bool loaded = trial_data.loadFromFile (trial.filename.c_str());
+		trial.load_duration = timer_stop (&timer);
+
+		if (!loaded) {
+			cerr << "Error: could not load trial " << trial.filename << ", skipping it." << endl;
+			trial.failed = true;
+			continue;
+		}
+
+		timer_start (&timer);
+		batch_fitter.setFitContextData (context, &trial_data);
+
+		int frame_first = trial_data.getFirstFrame();
+		int frame_last = trial_data.getLastFrame();
+		double frame_rate = static_cast<double>(trial_data.getFrameRate());
+		trial.frame_count = frame_last - frame_first + 1;
+
+		std::vector<FittedFrame> fitted_frames (trial.frame_count);
+
+		FitCache trial_cache;
+		if (cache_dir != "")
+			trial_cache.open (cache_dir, get_fit_cache_key (job->parameter_hash, &trial_data), frame_first, job->initial_state.size(), marker_names.size());
+
+		trial.cached_frames = std::min (static_cast<int>(trial_cache.frames.size()), trial.frame_count);
+		for (int fi = 0; fi < trial.cached_frames; fi++) {
+			fitted_frames[fi] = trial_cache.frames[fi];
+		}
+
+		// the fit continues from the last cached pose and the fitted frames
+		// are added to the cache block by block
+		int block_frames = trial_cache.isOpen() ? FIT_CACHE_BLOCK_FRAMES : trial.frame_count;
+		for (int block_start = trial.cached_frames; block_start < trial.frame_count; block_start += block_frames) {
+			int block_end = std::min (block_start + block_frames, trial.frame_count) - 1;
+			bool continued = block_start > 0;
+			const VectorNd &block_state = continued ? fitted_frames[block_start - 1].state : job->initial_state;
+
+			batch_fitter.fitFrameRangeSequential (context, block_state, continued, frame_first + block_start, frame_first + block_end, &fitted_frames[block_start]);
+
+			if (trial_cache.isOpen()) {
+				for (int fi = block_start; fi <= block_end; fi++) {
+					trial_cache.addFrame (fitted_frames[fi]);
+				}
+				trial_cache.flush();
+			}
+		}
+		trial_cache.close();
+
+		FittingLog trial_log;
+		if (batch_fitter.logFormat != FittingLogNone) {
+			string log_filename = trial.output_name + "_fitting_log" + (batch_fitter.logFormat == FittingLogBinary ? ".bin" : ".csv");
+			trial_log.open (log_filename.c_str(), batch_fitter.logFormat, marker_names, false);
+		}
+
+		Animation trial_animation;
+		double rms_sum = 0.;
+
+		for (int fi = 0; fi < trial.frame_count; fi++) {
+			const FittedFrame &fitted = fitted_frames[fi];
+
+			if (fitted.success)
+				trial.converged_frames++;
+			trial.steps += fitted.steps;
+			trial.max_frame_steps = std::max (trial.max_frame_steps, fitted.steps);
+
+			double squared_sum = 0.;
+			for (size_t mi = 0; mi < fitted.markerErrors.size(); mi++) {
+				squared_sum += fitted.markerErrors[mi] * fitted.markerErrors[mi];
+			}
+
+			double rms = 0.;
+			if (fitted.markerErrors.size() > 0)
+				rms = sqrt (squared_sum / static_cast<double>(fitted.markerErrors.size()));
+			rms_sum += rms;
+			trial.rms_max = std::max (trial.rms_max, rms);
+
+			trial_log.addFrame (fi, fitted.steps, fitted.markerErrors);
+			trial_animation.addPose (static_cast<double>(fi) / frame_rate, fitted.state);
+		}
+
+		trial_log.close();
+		batch_fitter.printMissingMarkerSummary (context, frame_first, frame_last);
+		trial_animation.saveToFile ((trial.output_name + ".csv").c_str());
+
+		trial.rms_mean = rms_sum / std::max (trial.frame_count, 1);
+		trial.fit_duration = timer_stop (&timer);
+
+		// the data must not be used by the context once it is destroyed
+		batch_fitter.setFitContextData (context, NULL);
+	}
+}
+
+/** Returns the file name without directory and extension. */
+string get_trial_name (const string &filename) {
+	size_t name_start = filename.find_last_of ("/\\");
+	name_start = (name_start == string::npos) ? 0 : name_start + 1;
+
+	size_t extension_start = filename.find_last_of (".");
+	if (extension_start == string::npos || extension_start < name_start)
+		extension_start = filename.size();
+
+	return filename.substr (name_start, extension_start - name_start);
+}
+
+/** Fits all trials with the model that was loaded once. The trials are
+ * distributed over the worker threads, each of which uses its own copy of
+ * the RBDL model. */
+bool run_batch () {
+	BatchJob job;
+	job.fitter = fitter;
+	job.initial_state = model->modelStateQ;
+	job.next_trial = 0;
+	job.parameter_hash = 0;
+	job.trials.resize (trial_files.size());
+
+	// the frames of each trial are fitted sequentially, optionally coarse
+	// to fine
+	fitter->coarseStride = coarse_stride;
+	if (cache_dir != "") {
+		fitter->threadCount = 1;
+		job.parameter_hash = fitter->calcParameterHash (job.initial_state);
+		fitter->threadCount = thread_count;
+	}
+
+	for (size_t ti = 0; ti < trial_files.size(); ti++) {
+		job.trials[ti].filename = trial_files[ti];
+		job.trials[ti].output_name = output_dir + "/" + get_trial_name (trial_files[ti]);
+
+		for (size_t tj = 0; tj < ti; tj++) {
+			if (job.trials[tj].output_name == job.trials[ti].output_name) {
+				cerr << "Error: trials " << trial_files[tj] << " and " << trial_files[ti] << " would be saved to the same file." << endl;
+				return false;
+			}
+		}
+	}
+
+	unsigned int worker_count = thread_count;
+	if (worker_count == 0)
+		worker_count = std::max (1u, std::thread::hardware_concurrency());
+	worker_count = std::min (worker_count, static_cast<unsigned int>(job.trials.size()));
+
+	TimerInfo timer;
+	timer_start (&timer);
+
+	// contexts have to be created on the thread that owns the model
+	std::vector<ModelFitter::FitContext*> worker_contexts;
+	std::vector<std::thread> workers;
+	for (unsigned int wi = 0; wi < worker_count; wi++) {
+		worker_contexts.push_back (fitter->createFitContext());
+	}
+	for (unsigned int wi = 0; wi < worker_count; wi++) {
+		workers.push_back (std::thread (fit_trials_worker, &job, worker_contexts[wi]));
+	}
+	for (unsigned int wi = 0; wi < worker_count; wi++) {
+		workers[wi].join();
+		fitter->destroyFitContext (worker_contexts[wi]);
+	}
+
+	double duration = timer_stop (&timer);
+
+	string summary_filename = output_dir + "/batch_summary.csv";
+	ofstream summary (summary_filename.c_str());
+	if (!summary)
+		cerr << "Error: cannot write batch summary " << summary_filename << endl;
+
+	const char *header = "trial, frames, converged frames, steps, steps per frame, max steps, mean rms residual, max rms residual, load [s], fit [s], cached frames, status";
+	cout << header << endl;
+	summary << header << "\n";
+
+	int total_frames = 0;
+	int total_converged = 0;
+	int failed_trials = 0;
+	for (size_t ti = 0; ti < job.trials.size(); ti++) {
+		const BatchTrial &trial = job.trials[ti];
+		total_frames += trial.frame_count;
+		total_converged += trial.converged_frames;
+		if (trial.failed)
+			failed_trials++;
+
+		ostringstream row;
+		row << trial.filename << ", "
+			<< trial.frame_count << ", "
+			<< trial.converged_frames << ", "
+			<< trial.steps << ", "
+			<< static_cast<double>(trial.steps) / std::max (trial.frame_count, 1) << ", "
+			<< trial.max_frame_steps << ", "
+			<< trial.rms_mean << ", "
+			<< trial.rms_max << ", "
+			<< trial.load_duration << ", "
+			<< trial.fit_duration << ", "
+			<< trial.cached_frames << ", "
+			<< (trial.failed ? "failed" : "fitted");
+
+		cout << row.str() << endl;
+		summary << row.str() << "\n";
+	}
+
+	cout << "Fitted " << job.trials.size() << " trials (" << total_converged << " of " << total_frames
+		<< " frames converged) with " << worker_count << " threads in " << duration << " s" << endl;
+
+	if (failed_trials > 0)
+		cerr << "Error: " << failed_trials << " of " << job.trials.size() << " trials could not be loaded." << endl;
+
+	return failed_trials == 0 && total_converged == total_frames;
+}
+
 int main (int argc, char* argv[]) {
 	parse_args (argc, argv);
 
+	if (batch_mode || trial_files.size() > 1) {
+		if (!model || trial_files.size() == 0) {
+			print_usage(argv[0]);
+			return 1;
+		}
+
+		fitter = create_fitter (fitter_method);
+		bool batch_result = run_batch();
+
+		delete fitter;
+		delete model;
+
+		return batch_result ? 0 : 1;
+	}
+
+	// only a plain fit can process the data window by window
+	bool stream_mode = stream_frames > 0
+		&& cache_dir == ""
+		&& !compare_sequential
+		&& !compare_fitters_mode
+		&& !benchmark_mode
+		&& !analyze_mode;
+
+	if (stream_frames > 0 && !stream_mode)
+		cerr << "Warning: --stream is ignored with the given options, all frames are loaded." << endl;
+
+	if (trial_files.size() == 1) {
+		data = new MarkerData();
+		data->useMarkerCache = use_marker_cache;
+		if (stream_mode) {
+			if (!data->openFile (trial_files[0].c_str()))
+				return 1;
+		} else if (!data->loadFromFile (trial_files[0].c_str())) {
+			return 1;
+		}
+	}
+
 	if (!model || !data)
 		print_usage(argv[0]);
 
-	if (fitter_method == "sugihara") {
-		fitter = new SugiharaFitter(model, data, max_steps);
-	} else if (fitter_method == "sugiharats") {
-		fitter = new SugiharaTaskSpaceFitter(model, data, max_steps);
-	} else {
-		fitter = new LevenbergMarquardtFitter (model, data, max_steps);
+	fitter = create_fitter (fitter_method);
+
+	if (stream_mode) {
+		TimerInfo timer;
+		timer_start(&timer);
+		bool result = fitter->streamModelAnimationFromMarkers (model->modelStateQ, stream_frames, "animation.csv");
+		cout << "Duration: " << timer_stop(&timer) << endl;
+		cout << "IK steps: " << fitter->animationSteps << " ("
+			<< static_cast<double>(fitter->animationSteps) / (data->getLastFrame() - data->getFirstFrame() + 1)
+			<< " per frame)" << endl;
+
+		if (!result) {
+			cout << "Fit failed!" << endl;
+		} else {
+			cout << "Fit successful!" << endl;
+		}
+
+		delete fitter;
+		delete model;
+		delete data;
+
+		return result ? 0 : 1;
+	}
+
+	if (compare_fitters_mode) {
+		run_fitter_comparison();
+		return 0;
+	}
+
+	if (benchmark_mode) {
+		run_benchmark();
+		return 0;
 	}
 
 	if (analyze_mode) {
-		fitter->analyzeAnimation (*animation);
+		std::vector<MarkerErrorStatistics> statistics;
+		fitter->analyzeAnimation (*animation, &statistics);
+
+		cout << "marker, frames, missing frames, mean, standard deviation, median, 95th percentile, max [m]" << endl;
+		for (size_t mi = 0; mi < statistics.size(); mi++) {
+			const MarkerErrorStatistics &marker_statistics = statistics[mi];
+			cout << marker_statistics.markerName << ", "
+				<< marker_statistics.frameCount << ", "
+				<< marker_statistics.missingFrameCount << ", "
+				<< marker_statistics.mean << ", "
+				<< marker_statistics.standardDeviation << ", "
+				<< marker_statistics.median << ", "
+				<< marker_statistics.percentile95 << ", "
+				<< marker_statistics.max << endl;
+		}
 		return 0;
 	}
 
@@ -120,9 +835,54 @@ int main (int argc, char* argv[]) {
 
 	TimerInfo timer;
 
+	// the reference fit is done first so that fitting_log.csv contains the
+	// log of the actual fit
+	Animation reference;
+	double reference_duration = 0.;
+	if (compare_sequential) {
+		fitter->coarseStride = 1;
+		fitter->threadCount = 1;
+
+		timer_start(&timer);
+		fitter->computeModelAnimationFromMarkers (model->modelStateQ, &reference, data->getFirstFrame(), data->getLastFrame());
+		reference_duration = timer_stop(&timer);
+		cout << "Sequential duration: " << reference_duration << endl;
+
+		fitter->threadCount = thread_count;
+	}
+	fitter->coarseStride = coarse_stride;
+
 	timer_start(&timer);
 	bool result = fitter->computeModelAnimationFromMarkers (model->modelStateQ, animation, data->getFirstFrame(), data->getLastFrame());
-	cout << "Duration: " << timer_stop(&timer) << endl;
+	double duration = timer_stop(&timer);
+	cout << "Duration: " << duration << endl;
+	if (cache_dir != "")
+		cout << "Frames read from cache: " << fitter->animationCachedFrames << endl;
+	cout << "IK steps: " << fitter->animationSteps << " ("
+		<< static_cast<double>(fitter->animationSteps) / (data->getLastFrame() - data->getFirstFrame() + 1)
+		<< " per frame, see fitting_log.csv for each frame)" << endl;
+
+	if (compare_sequential) {
+		double max_difference = 0.;
+		double squared_sum = 0.;
+		size_t value_count = 0;
+
+		for (size_t i = 0; i < std::min (animation->keyFrames.size(), reference.keyFrames.size()); i++) {
+			const VectorNd &state = animation->keyFrames[i].state;
+			const VectorNd &reference_state = reference.keyFrames[i].state;
+
+			for (size_t j = 0; j < state.size(); j++) {
+				double difference = fabs (state[j] - reference_state[j]);
+				max_difference = std::max (max_difference, difference);
+				squared_sum += difference * difference;
+				value_count++;
+			}
+		}
+
+		cout << "Difference to sequential fit: max " << max_difference
+			<< ", rms " << sqrt (squared_sum / std::max (value_count, static_cast<size_t>(1)))
+			<< ", speedup " << reference_duration / duration << endl;
+	}
 
 	if (!result) {
 		cout << "Fit failed!" << endl;
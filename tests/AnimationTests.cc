@@ -129,3 +129,25 @@ TEST ( TestAnimationGetInterpolated ) {
 	pose = animation.getCurrentPose();
 	CHECK_EQUAL (pose_5, pose);
 }
+
+TEST ( TestAnimationGetPoseAtMatchesCurrentPose ) {
+	Animation animation;
+
+	for (int i = 0; i < 5; i++) {
+		VectorNd pose (3);
+		pose << i * i, -i, 2. * i;
+		animation.addPose (i * 0.5, pose);
+	}
+
+	size_t key_index = 0;
+	VectorNd pose;
+	double times[] = { -1., 0., 0.2, 0.5, 0.7, 1.6, 2., 3., 1.1, 0.3 };
+
+	for (size_t i = 0; i < sizeof(times) / sizeof(double); i++) {
+		animation.setCurrentTime (times[i]);
+		VectorNd current_pose = animation.getCurrentPose();
+
+		animation.getPoseAt (times[i], &key_index, &pose);
+		CHECK_ARRAY_CLOSE (current_pose.data(), pose.data(), 3, TEST_PREC);
+	}
+}
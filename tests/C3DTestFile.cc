@@ -0,0 +1,167 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#include "C3DTestFile.h"
+
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+
+void append_bytes (std::string *buffer, const void *data, size_t size) {
+	buffer->append (static_cast<const char*>(data), size);
+}
+
+void append_int8 (std::string *buffer, Sint8 value) {
+	append_bytes (buffer, &value, sizeof(Sint8));
+}
+
+void append_int16 (std::string *buffer, Sint16 value) {
+	append_bytes (buffer, &value, sizeof(Sint16));
+}
+
+void append_parameter_name (std::string *buffer, const std::string &name, Sint8 group_id) {
+	append_int8 (buffer, static_cast<Sint8>(name.size()));
+	append_int8 (buffer, group_id);
+	buffer->append (name);
+}
+
+void append_point_parameters (std::string *buffer, const std::vector<std::string> &labels, Sint16 data_start_block) {
+	append_parameter_name (buffer, "POINT", -1);
+	append_int16 (buffer, 1);
+	append_int8 (buffer, 0);
+
+	append_parameter_name (buffer, "USED", 1);
+	append_int16 (buffer, 1);
+	append_int8 (buffer, 2);
+	append_int8 (buffer, 0);
+	append_int16 (buffer, static_cast<Sint16>(labels.size()));
+	append_int8 (buffer, 0);
+
+	append_parameter_name (buffer, "SCALE", 1);
+	append_int16 (buffer, 1);
+	append_int8 (buffer, 4);
+	append_int8 (buffer, 0);
+	float scale = -1.f;
+	append_bytes (buffer, &scale, sizeof(float));
+	append_int8 (buffer, 0);
+
+	append_parameter_name (buffer, "DATA_START", 1);
+	append_int16 (buffer, 1);
+	append_int8 (buffer, 2);
+	append_int8 (buffer, 0);
+	append_int16 (buffer, data_start_block);
+	append_int8 (buffer, 0);
+
+	// labels are stored column major with 4 characters per label
+	append_parameter_name (buffer, "LABELS", 1);
+	append_int16 (buffer, 0);
+	append_int8 (buffer, -1);
+	append_int8 (buffer, 2);
+	Uint8 label_dimensions[2] = { 4, static_cast<Uint8>(labels.size()) };
+	append_bytes (buffer, label_dimensions, sizeof(label_dimensions));
+	for (size_t i = 0; i < labels.size(); i++) {
+		std::string label = labels[i].substr (0, 4);
+		label.resize (4, ' ');
+		buffer->append (label);
+	}
+	append_int8 (buffer, 0);
+}
+
+bool write_test_c3d (const char *filename, const std::vector<std::string> &labels, int frame_count, const std::vector<float> &point_words) {
+	if (point_words.size() != labels.size() * 4 * frame_count)
+		return false;
+
+	// the parameters are written to the blocks between the header and the
+	// data, the size of the label parameter depends on the label count
+	Sint16 data_start_block = static_cast<Sint16>(3 + (labels.size() * 4 + 128) / 512);
+
+	C3DHeader header;
+	memset (&header, 0, sizeof(C3DHeader));
+	header.first_parameter = 2;
+	header.c3d_id = 0x50;
+	header.num_markers = static_cast<Uint16>(labels.size());
+	header.analog_channels = 0;
+	header.first_frame = 1;
+	header.last_frame = static_cast<Uint16>(frame_count);
+	header.scale_factor = -1.f;
+	header.start_record = data_start_block;
+	header.video_sampling_rate = 100.f;
+
+	std::string parameters;
+	ParameterHeader parameter_header = { 1, 0x50, static_cast<Uint8>(data_start_block - 2), 84 };
+	append_bytes (&parameters, &parameter_header, sizeof(ParameterHeader));
+	append_point_parameters (&parameters, labels, data_start_block);
+
+	if (parameters.size() > 512 * static_cast<size_t>(data_start_block - 2))
+		return false;
+	parameters.resize (512 * (data_start_block - 2), '\0');
+
+	ofstream file (filename, ios::binary | ios::trunc);
+	file.write (reinterpret_cast<const char*>(&header), sizeof(C3DHeader));
+	file.write (parameters.data(), parameters.size());
+	if (!point_words.empty())
+		file.write (reinterpret_cast<const char*>(&point_words[0]), point_words.size() * sizeof(float));
+
+	return static_cast<bool>(file);
+}
+
+/** Writes the values as a Lua table, e.g. "{0, 0, 1}". */
+void write_lua_values (ostream &stream, const std::vector<double> &values) {
+	stream << "{";
+	for (size_t i = 0; i < values.size(); i++) {
+		if (i > 0)
+			stream << ", ";
+		stream << values[i];
+	}
+	stream << "}";
+}
+
+void write_test_model (const char *filename, const std::vector<std::vector<double> > &joint_axes, const std::map<std::string, std::vector<double> > &markers) {
+	ofstream model_file (filename);
+	model_file << "return {" << endl
+		<< "  frames = {" << endl
+		<< "    {" << endl
+		<< "      name = \"body\"," << endl
+		<< "      parent = \"ROOT\"," << endl
+		<< "      joint = { ";
+	for (size_t i = 0; i < joint_axes.size(); i++) {
+		if (i > 0)
+			model_file << ", ";
+		write_lua_values (model_file, joint_axes[i]);
+	}
+	model_file << " }," << endl
+		<< "      body = { mass = 1, com = {0, 0, 0}, inertia = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}} }," << endl
+		<< "      markers = {" << endl;
+	for (std::map<std::string, std::vector<double> >::const_iterator marker_iter = markers.begin(); marker_iter != markers.end(); marker_iter++) {
+		model_file << "        " << marker_iter->first << " = ";
+		write_lua_values (model_file, marker_iter->second);
+		model_file << "," << endl;
+	}
+	model_file << "      }," << endl
+		<< "    }," << endl
+		<< "  }," << endl
+		<< "}" << endl;
+}
@@ -0,0 +1,64 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#ifndef C3D_TEST_FILE_H
+#define C3D_TEST_FILE_H
+
+#include "c3dtypes.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/** Helpers to write small C3D files and models for the tests. */
+
+void append_bytes (std::string *buffer, const void *data, size_t size);
+void append_int8 (std::string *buffer, Sint8 value);
+void append_int16 (std::string *buffer, Sint16 value);
+void append_parameter_name (std::string *buffer, const std::string &name, Sint8 group_id);
+
+/** Appends the parameter groups POINT with the parameters USED, SCALE,
+ * DATA_START and LABELS (4 characters per label) to the parameter section
+ * in buffer. */
+void append_point_parameters (std::string *buffer, const std::vector<std::string> &labels, Sint16 data_start_block);
+
+/** Writes a C3D file with float point data and 100 frames per second.
+ *
+ * point_words contains 4 values (x, y, z in millimeters and the residual)
+ * for each label at each frame, frame after frame. A negative residual
+ * marks a point as invalid.
+ */
+bool write_test_c3d (const char *filename, const std::vector<std::string> &labels, int frame_count, const std::vector<float> &point_words);
+
+/** Writes a Lua model with a single body attached to the root.
+ *
+ * joint_axes contains the 6 values of each axis of the joint (rotation
+ * followed by translation) and markers the body coordinates (in meters)
+ * of each marker.
+ */
+void write_test_model (const char *filename, const std::vector<std::vector<double> > &joint_axes, const std::map<std::string, std::vector<double> > &markers);
+
+/* C3D_TEST_FILE_H */
+#endif
@@ -0,0 +1,107 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2015 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include <UnitTest++.h>
+
+#include "FitCache.h"
+
+#include <iostream>
+#include <fstream>
+
+using namespace std;
+
+FittedFrame create_cached_frame (int index) {
+	FittedFrame frame;
+	frame.state = VectorNd::Zero (3);
+	frame.state[0] = index;
+	frame.state[2] = -0.5 * index;
+	frame.steps = index + 1;
+	frame.success = (index % 2 == 0);
+	frame.markerErrors.push_back (1.0e-3 * index);
+	frame.markerErrors.push_back (0.);
+
+	return frame;
+}
+
+TEST ( TestFitCacheReadsWrittenFrames ) {
+	FitCache cache;
+	CHECK (cache.open (".", "fit_cache_test_read", 10, 3, 2));
+	CHECK_EQUAL (0u, cache.frames.size());
+
+	for (int i = 0; i < 5; i++) {
+		cache.addFrame (create_cached_frame (i));
+	}
+	cache.close();
+
+	FitCache reopened;
+	CHECK (reopened.open (".", "fit_cache_test_read", 10, 3, 2));
+	CHECK_EQUAL (5u, reopened.frames.size());
+	for (int i = 0; i < 5; i++) {
+		FittedFrame expected = create_cached_frame (i);
+		CHECK_ARRAY_EQUAL (expected.state.data(), reopened.frames[i].state.data(), 3);
+		CHECK_EQUAL (expected.steps, reopened.frames[i].steps);
+		CHECK_EQUAL (expected.success, reopened.frames[i].success);
+		CHECK_ARRAY_EQUAL (expected.markerErrors, reopened.frames[i].markerErrors, 2);
+	}
+	reopened.close();
+
+	// entries of a different layout are discarded
+	CHECK (reopened.open (".", "fit_cache_test_read", 10, 4, 2));
+	CHECK_EQUAL (0u, reopened.frames.size());
+	reopened.close();
+
+	remove ("./fit_cache_test_read.fit");
+}
+
+TEST ( TestFitCacheResumesAfterIncompleteFrame ) {
+	FitCache cache;
+	CHECK (cache.open (".", "fit_cache_test_resume", 0, 3, 2));
+	for (int i = 0; i < 4; i++) {
+		cache.addFrame (create_cached_frame (i));
+	}
+	cache.close();
+
+	// simulate a crash while the last frame was written
+	ifstream entry ("./fit_cache_test_resume.fit", ios::binary);
+	string contents ((istreambuf_iterator<char>(entry)), istreambuf_iterator<char>());
+	entry.close();
+	ofstream truncated ("./fit_cache_test_resume.fit", ios::binary | ios::trunc);
+	truncated.write (contents.c_str(), contents.size() - 7);
+	truncated.close();
+
+	CHECK (cache.open (".", "fit_cache_test_resume", 0, 3, 2));
+	CHECK_EQUAL (3u, cache.frames.size());
+	cache.addFrame (create_cached_frame (3));
+	cache.addFrame (create_cached_frame (4));
+	cache.close();
+
+	CHECK (cache.open (".", "fit_cache_test_resume", 0, 3, 2));
+	CHECK_EQUAL (5u, cache.frames.size());
+	CHECK_EQUAL (4., cache.frames[4].state[0]);
+	CHECK_EQUAL (5u, cache.frames[4].steps);
+	cache.close();
+
+	remove ("./fit_cache_test_resume.fit");
+}
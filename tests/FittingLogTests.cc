@@ -0,0 +1,147 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#include <UnitTest++.h>
+
+#include "FittingLog.h"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+using namespace std;
+
+const int fitting_log_frame_count = static_cast<int>(FITTING_LOG_BUFFER_FRAMES) * 2 + 100;
+
+std::vector<std::string> get_fitting_log_marker_names () {
+	std::vector<std::string> marker_names;
+	marker_names.push_back ("LASI");
+	marker_names.push_back ("RASI");
+	marker_names.push_back ("C7");
+
+	return marker_names;
+}
+
+double get_fitting_log_residual (int frame, size_t marker_index) {
+	return 1.0e-4 * (frame % 500) + 0.25 * marker_index;
+}
+
+/** Writes fitting_log_frame_count frames so that several buffers are
+ * handed to the writer thread before the log is closed. */
+void write_fitting_log (const char *filename, FittingLogFormat format) {
+	std::vector<std::string> marker_names = get_fitting_log_marker_names();
+
+	FittingLog log;
+	CHECK (log.open (filename, format, marker_names, false));
+
+	std::vector<double> marker_errors (marker_names.size());
+	for (int frame = 0; frame < fitting_log_frame_count; frame++) {
+		for (size_t mi = 0; mi < marker_errors.size(); mi++) {
+			marker_errors[mi] = get_fitting_log_residual (frame, mi);
+		}
+		log.addFrame (frame, frame % 7, marker_errors);
+	}
+
+	log.close();
+	CHECK (!log.isOpen());
+}
+
+TEST ( TestFittingLogCSVRoundTrip ) {
+	const char *filename = "fitting_log_test.csv";
+	write_fitting_log (filename, FittingLogCSV);
+
+	ifstream log_file (filename);
+	string line;
+	CHECK (!getline (log_file, line).fail());
+	CHECK_EQUAL ("frame, steps, LASI, RASI, C7", line);
+
+	int frame_count = 0;
+	while (getline (log_file, line)) {
+		istringstream values (line);
+		int frame = -1;
+		unsigned int steps = 0;
+		char separator;
+		values >> frame >> separator >> steps;
+
+		CHECK_EQUAL (frame_count, frame);
+		CHECK_EQUAL (static_cast<unsigned int>(frame % 7), steps);
+
+		for (size_t mi = 0; mi < 3; mi++) {
+			double residual = -1.;
+			values >> separator >> residual;
+			CHECK_CLOSE (get_fitting_log_residual (frame, mi), residual, 1.0e-5);
+		}
+		CHECK (!values.fail());
+
+		frame_count++;
+	}
+	CHECK_EQUAL (fitting_log_frame_count, frame_count);
+
+	remove (filename);
+}
+
+TEST ( TestFittingLogBinaryRoundTrip ) {
+	const char *filename = "fitting_log_test.bin";
+	write_fitting_log (filename, FittingLogBinary);
+
+	ifstream log_file (filename, ios::binary);
+	char magic[8];
+	log_file.read (magic, sizeof(magic));
+	CHECK (memcmp (magic, FITTING_LOG_MAGIC, sizeof(magic)) == 0);
+
+	uint32_t marker_count = 0;
+	log_file.read (reinterpret_cast<char*>(&marker_count), sizeof(marker_count));
+	CHECK_EQUAL (3u, marker_count);
+
+	std::vector<std::string> marker_names = get_fitting_log_marker_names();
+	for (size_t mi = 0; mi < marker_names.size(); mi++) {
+		string name;
+		CHECK (!getline (log_file, name, '\0').fail());
+		CHECK_EQUAL (marker_names[mi], name);
+	}
+
+	int frame_count = 0;
+	int32_t frame;
+	while (log_file.read (reinterpret_cast<char*>(&frame), sizeof(frame))) {
+		uint32_t steps = 0;
+		float residuals[3];
+		log_file.read (reinterpret_cast<char*>(&steps), sizeof(steps));
+		log_file.read (reinterpret_cast<char*>(residuals), sizeof(residuals));
+		CHECK (!log_file.fail());
+
+		CHECK_EQUAL (frame_count, frame);
+		CHECK_EQUAL (static_cast<uint32_t>(frame % 7), steps);
+		for (size_t mi = 0; mi < 3; mi++) {
+			CHECK_CLOSE (get_fitting_log_residual (frame, mi), residuals[mi], 1.0e-6);
+		}
+
+		frame_count++;
+	}
+	CHECK_EQUAL (fitting_log_frame_count, frame_count);
+
+	remove (filename);
+}
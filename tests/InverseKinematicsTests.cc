@@ -0,0 +1,330 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2015 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+// Eigen allocates with malloc() which is not seen by the operator new
+// counter below. With this define Eigen asserts on heap allocations while
+// Eigen::internal::set_is_malloc_allowed (false) is in effect. It has to be
+// defined before Eigen or RBDL are included (the SceneGL library that
+// contains the IK is built with it, too).
+#ifndef EIGEN_RUNTIME_NO_MALLOC
+#define EIGEN_RUNTIME_NO_MALLOC
+#endif
+
+#include <UnitTest++.h>
+
+#include "InverseKinematics.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+typedef RigidBodyDynamics::Math::Vector3d rbdlVector3d;
+typedef RigidBodyDynamics::Math::VectorNd rbdlVectorNd;
+
+const double TEST_PREC = 1.0e-6;
+
+// counts all allocations made using operator new (e.g. by std::vector)
+static unsigned int new_count = 0;
+
+void* operator new (size_t size) {
+	new_count++;
+	void *ptr = malloc (size);
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void operator delete (void *ptr) throw() {
+	free (ptr);
+}
+
+/** Planar three link arm with markers at the tips of the second and third
+ * link. */
+struct PlanarArmFixture {
+	PlanarArmFixture() {
+		RigidBodyDynamics::Body body (1., rbdlVector3d (0.5, 0., 0.), rbdlVector3d (0.1, 0.1, 0.1));
+		RigidBodyDynamics::Joint joint (RigidBodyDynamics::Math::SpatialVector (0., 0., 1., 0., 0., 0.));
+
+		unsigned int body_1 = model.AddBody (0, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (0., 0., 0.)), joint, body, "body_1");
+		unsigned int body_2 = model.AddBody (body_1, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (1., 0., 0.)), joint, body, "body_2");
+		unsigned int body_3 = model.AddBody (body_2, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (1., 0., 0.)), joint, body, "body_3");
+
+		body_ids.push_back (body_2);
+		body_points.push_back (rbdlVector3d (1., 0., 0.));
+		body_ids.push_back (body_3);
+		body_points.push_back (rbdlVector3d (1., 0., 0.));
+
+		rbdlVectorNd q_target = rbdlVectorNd::Zero (model.q_size);
+		q_target[0] = 0.3;
+		q_target[1] = 0.4;
+		q_target[2] = -0.2;
+
+		for (size_t i = 0; i < body_ids.size(); i++) {
+			target_pos.push_back (CalcBodyToBaseCoordinates (model, q_target, body_ids[i], body_points[i]));
+			target_valid.push_back (true);
+		}
+
+		q_init = rbdlVectorNd::Zero (model.q_size);
+		q_res = rbdlVectorNd::Zero (model.q_size);
+	}
+
+	RigidBodyDynamics::Model model;
+	vector<unsigned int> body_ids;
+	vector<rbdlVector3d> body_points;
+	vector<rbdlVector3d> target_pos;
+	vector<bool> target_valid;
+	rbdlVectorNd q_init;
+	rbdlVectorNd q_res;
+	IKWorkspace workspace;
+};
+
+TEST_FIXTURE ( PlanarArmFixture, TestSugiharaIKReachesTargets ) {
+	unsigned int steps = 0;
+	bool result = SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 1.0e-12, 100, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+
+	CHECK (result);
+	for (size_t i = 0; i < body_ids.size(); i++) {
+		rbdlVector3d fitted_pos = CalcBodyToBaseCoordinates (model, q_res, body_ids[i], body_points[i]);
+		CHECK_ARRAY_CLOSE (target_pos[i].data(), fitted_pos.data(), 3, TEST_PREC);
+	}
+}
+
+TEST_FIXTURE ( PlanarArmFixture, TestAdaptiveLevenbergMarquardtIKReachesTargets ) {
+	unsigned int steps = 0;
+	bool result = AdaptiveLevenbergMarquardtIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 1.0e-12, 1.0e-14, 1.0e-3, 100, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+
+	CHECK (result);
+	for (size_t i = 0; i < body_ids.size(); i++) {
+		rbdlVector3d fitted_pos = CalcBodyToBaseCoordinates (model, q_res, body_ids[i], body_points[i]);
+		CHECK_ARRAY_CLOSE (target_pos[i].data(), fitted_pos.data(), 3, TEST_PREC);
+	}
+}
+
+TEST_FIXTURE ( PlanarArmFixture, TestBroydenJacobianUpdatesReachTargets ) {
+	IKWorkspace exact_workspace;
+	workspace.jacobianUpdateInterval = 5;
+
+	rbdlVectorNd q_target = rbdlVectorNd::Zero (model.q_size);
+	rbdlVectorNd q_exact = q_init;
+	unsigned int steps = 0;
+
+	// slowly moving targets as in marker data with a high frame rate
+	for (int frame = 0; frame < 50; frame++) {
+		q_target[0] = 0.3 + 0.005 * frame;
+		q_target[1] = 0.4 - 0.003 * frame;
+		q_target[2] = -0.2 + 0.004 * frame;
+
+		for (size_t i = 0; i < body_ids.size(); i++) {
+			target_pos[i] = CalcBodyToBaseCoordinates (model, q_target, body_ids[i], body_points[i]);
+		}
+
+		bool result = SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 1.0e-12, 100, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+		CHECK (result);
+		q_init = q_res;
+
+		SugiharaIK (model, q_exact, body_ids, body_points, target_pos, target_valid, q_exact, 1.0e-12, 100, IKSolverLLT, IKSystemAuto, true, exact_workspace, &steps);
+
+		for (size_t i = 0; i < body_ids.size(); i++) {
+			rbdlVector3d fitted_pos = CalcBodyToBaseCoordinates (model, q_res, body_ids[i], body_points[i]);
+			CHECK_ARRAY_CLOSE (target_pos[i].data(), fitted_pos.data(), 3, TEST_PREC);
+		}
+	}
+
+	CHECK (workspace.broydenUpdates > 0);
+	CHECK (workspace.exactJacobians < exact_workspace.exactJacobians);
+}
+
+TEST_FIXTURE ( PlanarArmFixture, TestIKWorkspaceIterationsDoNotAllocate ) {
+	unsigned int steps = 0;
+
+	// first run allocates the workspace
+	SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 1, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	CHECK_EQUAL (1u, workspace.allocations);
+
+	// From here on Eigen asserts if a matrix or vector is allocated on the
+	// heap. A step tolerance of 0 forces all iterations to be performed.
+	Eigen::internal::set_is_malloc_allowed (false);
+
+	unsigned int new_count_start = new_count;
+	SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 1, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	unsigned int new_count_single = new_count - new_count_start;
+
+	new_count_start = new_count;
+	SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 20, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	unsigned int new_count_many = new_count - new_count_start;
+	unsigned int sugihara_steps = steps;
+
+	new_count_start = new_count;
+	SugiharaTaskSpaceIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 20, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	new_count_many += new_count - new_count_start;
+
+	new_count_start = new_count;
+	LevenbergMarquardtIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 0.05, 20, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	new_count_many += new_count - new_count_start;
+
+	new_count_start = new_count;
+	AdaptiveLevenbergMarquardtIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 0., 1.0e-3, 20, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	new_count_many += new_count - new_count_start;
+
+	// missing markers must not change the size of the workspace
+	target_valid[0] = false;
+	new_count_start = new_count;
+	SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 20, IKSolverLLT, IKSystemAuto, true, workspace, &steps);
+	new_count_many += new_count - new_count_start;
+
+	Eigen::internal::set_is_malloc_allowed (true);
+
+	CHECK_EQUAL (20u, sugihara_steps);
+	CHECK_EQUAL (0u, new_count_single);
+	CHECK_EQUAL (0u, new_count_many);
+	CHECK_EQUAL (1u, workspace.allocations);
+}
+
+TEST_FIXTURE ( PlanarArmFixture, TestDampedStepSolversAgree ) {
+	unsigned int steps = 0;
+	SugiharaTaskSpaceIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 1, IKSolverQR, IKSystemTaskSpace, false, workspace, &steps);
+
+	rbdlVectorNd delta_theta_ref = workspace.delta_theta;
+
+	IKLinearSolver solvers[] = { IKSolverLLT, IKSolverLDLT, IKSolverQR };
+	IKSystemForm forms[] = { IKSystemJointSpace, IKSystemTaskSpace };
+
+	for (size_t si = 0; si < 3; si++) {
+		for (size_t fi = 0; fi < 2; fi++) {
+			calc_damped_step (workspace, solvers[si], forms[fi], false);
+			CHECK_ARRAY_CLOSE (delta_theta_ref.data(), workspace.delta_theta.data(), delta_theta_ref.size(), TEST_PREC);
+
+			calc_damped_step (workspace, solvers[si], forms[fi], true);
+			CHECK_ARRAY_CLOSE (delta_theta_ref.data(), workspace.delta_theta.data(), delta_theta_ref.size(), TEST_PREC);
+		}
+	}
+}
+
+TEST ( TestFixedSizeJointSystemMatchesDynamic ) {
+	// chain with the 34 degrees of freedom of model.lua and the HeiMan models
+	RigidBodyDynamics::Model model;
+	RigidBodyDynamics::Body body (1., rbdlVector3d (0., 0., 0.1), rbdlVector3d (0.1, 0.1, 0.1));
+	RigidBodyDynamics::Joint joint_y (RigidBodyDynamics::Math::SpatialVector (0., 1., 0., 0., 0., 0.));
+	RigidBodyDynamics::Joint joint_z (RigidBodyDynamics::Math::SpatialVector (0., 0., 1., 0., 0., 0.));
+
+	vector<unsigned int> body_ids;
+	vector<rbdlVector3d> body_points;
+	vector<rbdlVector3d> target_pos;
+	vector<bool> target_valid;
+
+	unsigned int parent = 0;
+	for (unsigned int i = 0; i < 34; i++) {
+		parent = model.AddBody (parent, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (0., 0., 0.2)), i % 2 ? joint_y : joint_z, body);
+
+		if (i % 4 == 3) {
+			body_ids.push_back (parent);
+			body_points.push_back (rbdlVector3d (0.1, 0., 0.2));
+			target_pos.push_back (rbdlVector3d (0.1 * i, 0.5, 0.2));
+			target_valid.push_back (true);
+		}
+	}
+
+	rbdlVectorNd q_init = rbdlVectorNd::Constant (model.q_size, 0.1);
+	rbdlVectorNd q_res = q_init;
+	IKWorkspace workspace;
+	unsigned int steps = 0;
+	SugiharaIK (model, q_init, body_ids, body_points, target_pos, target_valid, q_res, 0., 1, IKSolverLLT, IKSystemJointSpace, true, workspace, &steps);
+
+	CHECK (workspace.fixedJointSystem != NULL);
+
+	IKLinearSolver solvers[] = { IKSolverLLT, IKSolverLDLT, IKSolverQR };
+
+	for (size_t si = 0; si < 3; si++) {
+		for (int sparse = 0; sparse < 2; sparse++) {
+			workspace.useFixedSize = false;
+			calc_damped_step (workspace, solvers[si], IKSystemJointSpace, sparse == 1);
+			rbdlVectorNd delta_theta_dynamic = workspace.delta_theta;
+
+			workspace.useFixedSize = true;
+			calc_damped_step (workspace, solvers[si], IKSystemJointSpace, sparse == 1);
+			CHECK_ARRAY_CLOSE (delta_theta_dynamic.data(), workspace.delta_theta.data(), delta_theta_dynamic.size(), TEST_PREC);
+		}
+	}
+}
+
+TEST ( TestRootPoseInitializationRecoversFreeFlyer ) {
+	// free-flyer as created for the HeiMan pelvis
+	RigidBodyDynamics::Model model;
+	RigidBodyDynamics::Body body (1., rbdlVector3d (0., 0., 0.1), rbdlVector3d (0.1, 0.1, 0.1));
+	RigidBodyDynamics::Math::SpatialVector axes[6] = {
+		RigidBodyDynamics::Math::SpatialVector (0., 0., 0., 1., 0., 0.),
+		RigidBodyDynamics::Math::SpatialVector (0., 0., 0., 0., 1., 0.),
+		RigidBodyDynamics::Math::SpatialVector (0., 0., 0., 0., 0., 1.),
+		RigidBodyDynamics::Math::SpatialVector (0., 1., 0., 0., 0., 0.),
+		RigidBodyDynamics::Math::SpatialVector (1., 0., 0., 0., 0., 0.),
+		RigidBodyDynamics::Math::SpatialVector (0., 0., 1., 0., 0., 0.)
+	};
+
+	unsigned int root_id = 0;
+	for (unsigned int i = 0; i < 6; i++) {
+		root_id = model.AddBody (root_id, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (0., 0., 0.)), RigidBodyDynamics::Joint (axes[i]), body);
+	}
+	unsigned int leg_id = model.AddBody (root_id, RigidBodyDynamics::Math::Xtrans (rbdlVector3d (0., 0., -0.5)), RigidBodyDynamics::Joint (axes[3]), body);
+
+	RootFreeFlyer root;
+	CHECK (root.initialize (model));
+	CHECK_EQUAL (root_id, root.bodyId);
+
+	rbdlVectorNd q_target = rbdlVectorNd::Zero (model.q_size);
+	q_target[0] = 0.4;
+	q_target[1] = -0.2;
+	q_target[2] = 0.9;
+	q_target[3] = 0.3;
+	q_target[4] = -1.2;
+	q_target[5] = 2.5;
+	q_target[6] = 0.7;
+
+	vector<unsigned int> body_ids;
+	vector<rbdlVector3d> body_points;
+	vector<rbdlVector3d> target_pos;
+	vector<bool> target_valid;
+
+	body_points.push_back (rbdlVector3d (0.1, 0.1, 0.));
+	body_points.push_back (rbdlVector3d (0.1, -0.1, 0.));
+	body_points.push_back (rbdlVector3d (-0.1, 0., 0.05));
+	body_points.push_back (rbdlVector3d (0., 0., -0.3));
+
+	for (size_t i = 0; i < body_points.size(); i++) {
+		// the last marker is on the leg and must not be used
+		body_ids.push_back (i < 3 ? root_id : leg_id);
+		target_pos.push_back (CalcBodyToBaseCoordinates (model, q_target, body_ids[i], body_points[i]));
+		target_valid.push_back (true);
+	}
+
+	rbdlVectorNd q = rbdlVectorNd::Zero (model.q_size);
+	CHECK (calc_root_pose_initialization (model, root, body_ids, body_points, target_pos, target_valid, q));
+	CHECK_ARRAY_CLOSE (q_target.data(), q.data(), 6, TEST_PREC);
+	CHECK_EQUAL (0., q[6]);
+
+	// two root markers do not determine the pose
+	target_valid[0] = false;
+	CHECK (!calc_root_pose_initialization (model, root, body_ids, body_points, target_pos, target_valid, q));
+}
@@ -0,0 +1,179 @@
+/* 
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE* 
+ */
+
+#include <UnitTest++.h>
+
+#include "MarkerCache.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <limits>
+
+using namespace std;
+
+const char* marker_cache_source_filename = "marker_cache_test.c3d";
+
+void write_marker_cache_source (const char *contents) {
+	ofstream source (marker_cache_source_filename, ios::binary | ios::trunc);
+	source << contents;
+}
+
+/** Writes a cache of two markers LASI and RASI at three frames. */
+bool write_test_marker_cache () {
+	MarkerCacheHeader header;
+	memset (&header, 0, sizeof (MarkerCacheHeader));
+	header.sourceHash = 1234;
+	header.firstFrame = 5;
+	header.lastFrame = 7;
+	header.frameRate = 100.f;
+	header.markerCount = 2;
+	header.validityRowSize = 1;
+	header.backwardsFrameFraction = 0.25f;
+
+	vector<string> labels;
+	labels.push_back ("LASI");
+	labels.push_back ("RASI");
+
+	float positions[18];
+	for (int i = 0; i < 18; i++) {
+		positions[i] = 0.1f * i;
+	}
+
+	// RASI is missing at the second frame
+	uint64_t validity[3] = { 3, 1, 3 };
+
+	return MarkerCache::write (marker_cache_source_filename, header, labels, positions, validity);
+}
+
+TEST ( TestMarkerCacheReadsWrittenData ) {
+	write_marker_cache_source ("marker data");
+	CHECK (write_test_marker_cache ());
+
+	MarkerCache cache;
+	CHECK (cache.open (marker_cache_source_filename));
+	CHECK_EQUAL (1234u, cache.header.sourceHash);
+	CHECK_EQUAL (5, cache.header.firstFrame);
+	CHECK_EQUAL (3, cache.getFrameCount());
+	CHECK_EQUAL (100.f, cache.header.frameRate);
+	CHECK_EQUAL (0.25f, cache.header.backwardsFrameFraction);
+
+	CHECK_EQUAL (2u, cache.labels.size());
+	CHECK_EQUAL ("LASI", cache.labels[0]);
+	CHECK_EQUAL ("RASI", cache.labels[1]);
+
+	// sections can be accessed in place
+	CHECK_EQUAL (0u, reinterpret_cast<size_t>(cache.positions) % sizeof (float));
+	CHECK_EQUAL (0u, reinterpret_cast<size_t>(cache.validity) % sizeof (uint64_t));
+
+	CHECK_CLOSE (0.9f, cache.getPosition (1, 1)[0], 1.0e-6f);
+	CHECK_CLOSE (1.7f, cache.getPosition (1, 2)[2], 1.0e-6f);
+	CHECK_EQUAL (3u, cache.validity[0]);
+	CHECK_EQUAL (1u, cache.validity[1]);
+
+	cache.close();
+
+	remove (get_marker_cache_filename (marker_cache_source_filename).c_str());
+	remove (marker_cache_source_filename);
+}
+
+TEST ( TestMarkerCacheDiscardsStaleCache ) {
+	write_marker_cache_source ("marker data");
+	CHECK (write_test_marker_cache ());
+
+	MarkerCache cache;
+	CHECK (cache.open (marker_cache_source_filename));
+	cache.close();
+
+	// changing the marker data file invalidates the cache
+	write_marker_cache_source ("modified marker data");
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	// incomplete caches are not used
+	CHECK (write_test_marker_cache ());
+	string cache_filename = get_marker_cache_filename (marker_cache_source_filename);
+	ifstream cache_file (cache_filename.c_str(), ios::binary);
+	string contents ((istreambuf_iterator<char>(cache_file)), istreambuf_iterator<char>());
+	cache_file.close();
+	ofstream truncated (cache_filename.c_str(), ios::binary | ios::trunc);
+	truncated.write (contents.c_str(), contents.size() - 8);
+	truncated.close();
+
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	remove (cache_filename.c_str());
+	remove (marker_cache_source_filename);
+}
+
+/** Overwrites the header of the cache file with the given header. */
+void write_marker_cache_header (const MarkerCacheHeader &header) {
+	string cache_filename = get_marker_cache_filename (marker_cache_source_filename);
+	fstream cache_file (cache_filename.c_str(), ios::binary | ios::in | ios::out);
+	cache_file.write (reinterpret_cast<const char*>(&header), sizeof (MarkerCacheHeader));
+}
+
+TEST ( TestMarkerCacheRejectsInvalidOffsets ) {
+	write_marker_cache_source ("marker data");
+	CHECK (write_test_marker_cache ());
+
+	MarkerCache cache;
+	CHECK (cache.open (marker_cache_source_filename));
+	MarkerCacheHeader header = cache.header;
+	cache.close();
+
+	// sections behind the end of the file
+	MarkerCacheHeader corrupted = header;
+	corrupted.labelsOffset = header.fileSize / 64 * 64 + (1 << 20);
+	corrupted.positionsOffset = corrupted.labelsOffset + 64 * 1024;
+	corrupted.validityOffset = corrupted.positionsOffset + 64 * 1024;
+	write_marker_cache_header (corrupted);
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	corrupted = header;
+	corrupted.validityOffset = header.fileSize + 64;
+	write_marker_cache_header (corrupted);
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	// section sizes that overflow 64 bits
+	corrupted = header;
+	corrupted.labelsSize = std::numeric_limits<uint64_t>::max() - 8;
+	write_marker_cache_header (corrupted);
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	corrupted = header;
+	corrupted.firstFrame = -2000000000;
+	corrupted.lastFrame = 2000000000;
+	corrupted.markerCount = 0xffffffffu;
+	corrupted.validityRowSize = 0x4000000u;
+	write_marker_cache_header (corrupted);
+	CHECK (!cache.open (marker_cache_source_filename));
+
+	write_marker_cache_header (header);
+	CHECK (cache.open (marker_cache_source_filename));
+	cache.close();
+
+	remove (get_marker_cache_filename (marker_cache_source_filename).c_str());
+	remove (marker_cache_source_filename);
+}
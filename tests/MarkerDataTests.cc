@@ -0,0 +1,178 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#include <UnitTest++.h>
+
+#include "Model.h"
+#include "MarkerData.h"
+#include "ModelFitter.h"
+#include "C3DTestFile.h"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+using namespace std;
+
+const char* validity_c3d_filename = "marker_validity_test.c3d";
+const char* validity_model_filename = "marker_validity_test_model.lua";
+const int validity_marker_count = 70;
+const int validity_frame_count = 10;
+
+/** Whether the marker at the frame index is written with invalid data:
+ *  - M1 has a negative residual at frames 1 and 2,
+ *  - M2 is at the origin at frame 4,
+ *  - M3 is more than 10 m away at frames 5 to 7,
+ *  - M63, M64 and M65 (around the 64 bit word boundary) are invalid at
+ *    frames 8, 0 and 9 with each of the three reasons.
+ */
+bool is_validity_test_marker_invalid (int marker_index, int frame_index) {
+	switch (marker_index) {
+		case 1: return frame_index == 1 || frame_index == 2;
+		case 2: return frame_index == 4;
+		case 3: return frame_index >= 5 && frame_index <= 7;
+		case 63: return frame_index == 8;
+		case 64: return frame_index == 0;
+		case 65: return frame_index == 9;
+	}
+
+	return false;
+}
+
+bool write_validity_test_c3d (const char *filename) {
+	std::vector<std::string> labels;
+	for (int mi = 0; mi < validity_marker_count; mi++) {
+		ostringstream label;
+		label << "M" << mi;
+		labels.push_back (label.str());
+	}
+
+	std::vector<float> point_words;
+	for (int fi = 0; fi < validity_frame_count; fi++) {
+		for (int mi = 0; mi < validity_marker_count; mi++) {
+			float words[4] = { 100.f + mi, 200.f + fi, 300.f, 0.f };
+
+			if (is_validity_test_marker_invalid (mi, fi)) {
+				if (mi == 1 || mi == 64) {
+					words[3] = -1.f;
+				} else if (mi == 2 || mi == 65) {
+					words[0] = words[1] = words[2] = 0.f;
+				} else {
+					words[0] = 20000.f;
+				}
+			}
+
+			point_words.insert (point_words.end(), words, words + 4);
+		}
+	}
+
+	return write_test_c3d (filename, labels, validity_frame_count, point_words);
+}
+
+/** Writes a model with the markers M0 to M3, M63 to M65 and the marker
+ * MX that has no marker data. */
+void write_validity_test_model (const char *filename) {
+	write_test_model (filename,
+			{ {0, 0, 0, 1, 0, 0}, {0, 0, 0, 0, 1, 0}, {0, 0, 0, 0, 0, 1} },
+			{ {"M0", {0, 0, 0}}, {"M1", {0.1, 0, 0}}, {"M2", {0, 0.1, 0}}, {"M3", {0, 0, 0.1}},
+			  {"M63", {0.1, 0.1, 0}}, {"M64", {0.1, 0, 0.1}}, {"M65", {0, 0.1, 0.1}}, {"MX", {0.1, 0.1, 0.1}} });
+}
+
+TEST ( TestMarkerValidity ) {
+	CHECK (write_validity_test_c3d (validity_c3d_filename));
+
+	MarkerData data;
+	CHECK (data.loadFromFile (validity_c3d_filename));
+	CHECK_EQUAL (1, data.getFirstFrame());
+	CHECK_EQUAL (validity_frame_count, data.getLastFrame());
+	CHECK_EQUAL (2u, data.validityRowSize);
+
+	for (int mi = 0; mi < validity_marker_count; mi++) {
+		ostringstream label;
+		label << "M" << mi;
+		int marker_index = data.getMarkerIndex (label.str().c_str());
+		CHECK_EQUAL (mi, marker_index);
+
+		for (int fi = 0; fi < validity_frame_count; fi++) {
+			bool valid = data.isMarkerValid (marker_index, data.getFirstFrame() + fi);
+			CHECK_EQUAL (!is_validity_test_marker_invalid (mi, fi), valid);
+		}
+	}
+
+	CHECK_EQUAL (2, data.getMissingFrameCount (1, data.getFirstFrame(), data.getLastFrame()));
+	CHECK_EQUAL (3, data.getMissingFrameCount (3, data.getFirstFrame(), data.getLastFrame()));
+	CHECK_EQUAL (1, data.getMissingFrameCount (64, data.getFirstFrame(), data.getLastFrame()));
+	CHECK_EQUAL (0, data.getMissingFrameCount (64, data.getFirstFrame() + 1, data.getLastFrame()));
+
+	remove (validity_c3d_filename);
+}
+
+TEST ( TestMissingMarkerSummary ) {
+	CHECK (write_validity_test_c3d (validity_c3d_filename));
+	write_validity_test_model (validity_model_filename);
+
+	Model model;
+	model.loadFromFile (validity_model_filename);
+
+	MarkerData data;
+	CHECK (data.loadFromFile (validity_c3d_filename));
+
+	SugiharaFitter fitter (&model, &data, 100);
+	ModelFitter::FitContext *context = fitter.createFitContext();
+
+	ostringstream summary;
+	streambuf *cerr_buffer = cerr.rdbuf (summary.rdbuf());
+	fitter.printMissingMarkerSummary (context, data.getFirstFrame(), data.getLastFrame());
+	cerr.rdbuf (cerr_buffer);
+
+	fitter.destroyFitContext (context);
+
+	string output = summary.str();
+	CHECK (output.find ("invalid marker data for 7 markers in frames 1 to 10") != string::npos);
+	CHECK (output.find ("  M1: 2 frames\n") != string::npos);
+	CHECK (output.find ("  M2: 1 frames\n") != string::npos);
+	CHECK (output.find ("  M3: 3 frames\n") != string::npos);
+	CHECK (output.find ("  M63: 1 frames\n") != string::npos);
+	CHECK (output.find ("  M64: 1 frames\n") != string::npos);
+	CHECK (output.find ("  M65: 1 frames\n") != string::npos);
+	CHECK (output.find ("  MX: 10 frames (no data)\n") != string::npos);
+	CHECK (output.find ("  M0:") == string::npos);
+
+	// only the frames 4 and 5 are counted
+	summary.str ("");
+	context = fitter.createFitContext();
+	cerr_buffer = cerr.rdbuf (summary.rdbuf());
+	fitter.printMissingMarkerSummary (context, 4, 5);
+	cerr.rdbuf (cerr_buffer);
+	fitter.destroyFitContext (context);
+
+	output = summary.str();
+	CHECK (output.find ("invalid marker data for 2 markers in frames 4 to 5") != string::npos);
+	CHECK (output.find ("  M2: 1 frames\n") != string::npos);
+	CHECK (output.find ("  MX: 2 frames (no data)\n") != string::npos);
+
+	remove (validity_c3d_filename);
+	remove (validity_model_filename);
+}
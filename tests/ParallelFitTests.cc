@@ -0,0 +1,120 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#include <UnitTest++.h>
+
+#include "Model.h"
+#include "MarkerData.h"
+#include "ModelFitter.h"
+#include "Animation.h"
+#include "C3DTestFile.h"
+
+#include <cmath>
+#include <fstream>
+#include <cstdio>
+
+using namespace std;
+
+const char* parallel_c3d_filename = "parallel_fit_test.c3d";
+const char* parallel_model_filename = "parallel_fit_test_model.lua";
+const int parallel_frame_count = 400;
+
+/** Writes the marker data of a body that translates and rotates about the
+ * z-axis. The markers are at 0.1 m along each axis of the body. */
+bool write_parallel_fit_c3d (const char *filename) {
+	std::vector<std::string> labels;
+	labels.push_back ("M1");
+	labels.push_back ("M2");
+	labels.push_back ("M3");
+
+	const double local_positions[3][3] = { { 0.1, 0., 0. }, { 0., 0.1, 0. }, { 0., 0., 0.1 } };
+
+	std::vector<float> point_words;
+	for (int fi = 0; fi < parallel_frame_count; fi++) {
+		double translation[3] = { 0.1 + 0.1 * sin (fi * 0.03), 0.2, 0.3 + 0.05 * cos (fi * 0.05) };
+		double angle = 0.5 * sin (fi * 0.02);
+
+		for (int mi = 0; mi < 3; mi++) {
+			const double *r = local_positions[mi];
+			double position[3] = {
+				translation[0] + cos (angle) * r[0] - sin (angle) * r[1],
+				translation[1] + sin (angle) * r[0] + cos (angle) * r[1],
+				translation[2] + r[2]
+			};
+
+			for (int i = 0; i < 3; i++) {
+				point_words.push_back (static_cast<float>(position[i] * 1.0e3));
+			}
+			point_words.push_back (0.f);
+		}
+	}
+
+	return write_test_c3d (filename, labels, parallel_frame_count, point_words);
+}
+
+/** Writes a model with a single body that translates freely and rotates
+ * about the z-axis and carries the markers M1, M2 and M3. */
+void write_parallel_fit_model (const char *filename) {
+	write_test_model (filename,
+			{ {0, 0, 0, 1, 0, 0}, {0, 0, 0, 0, 1, 0}, {0, 0, 0, 0, 0, 1}, {0, 0, 1, 0, 0, 0} },
+			{ {"M1", {0.1, 0, 0}}, {"M2", {0, 0.1, 0}}, {"M3", {0, 0, 0.1}} });
+}
+
+TEST ( TestParallelFitMatchesSequentialFit ) {
+	CHECK (write_parallel_fit_c3d (parallel_c3d_filename));
+	write_parallel_fit_model (parallel_model_filename);
+
+	Model model;
+	model.loadFromFile (parallel_model_filename);
+
+	MarkerData data;
+	CHECK (data.loadFromFile (parallel_c3d_filename));
+	CHECK_EQUAL (parallel_frame_count, data.getLastFrame() - data.getFirstFrame() + 1);
+
+	LevenbergMarquardtFitter fitter (&model, &data, 100);
+	fitter.logFormat = FittingLogNone;
+
+	Animation sequential;
+	fitter.threadCount = 1;
+	CHECK (fitter.computeModelAnimationFromMarkers (model.modelStateQ, &sequential, data.getFirstFrame(), data.getLastFrame()));
+
+	// enough frames for several chunks on each thread
+	Animation parallel;
+	fitter.threadCount = 4;
+	CHECK (parallel_frame_count > static_cast<int>(fitter.threadCount * fitter.chunkOverlap));
+	CHECK (fitter.computeModelAnimationFromMarkers (model.modelStateQ, &parallel, data.getFirstFrame(), data.getLastFrame()));
+
+	CHECK_EQUAL (parallel_frame_count, static_cast<int>(sequential.keyFrames.size()));
+	CHECK_EQUAL (sequential.keyFrames.size(), parallel.keyFrames.size());
+
+	double max_difference = 0.;
+	for (size_t i = 0; i < std::min (sequential.keyFrames.size(), parallel.keyFrames.size()); i++) {
+		max_difference = std::max (max_difference, (sequential.keyFrames[i].state - parallel.keyFrames[i].state).norm());
+	}
+	CHECK (max_difference < fitter.chunkTolerance);
+
+	remove (parallel_c3d_filename);
+	remove (parallel_model_filename);
+}
@@ -0,0 +1,210 @@
+/*
+ * Puppeteer - A Motion Capture Mapping Tool
+ * Copyright (c) 2013-2016 Martin Felis <martin.felis@iwr.uni-heidelberg.de>.
+ * All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE*
+ */
+
+#include <UnitTest++.h>
+
+#include "Scene.h"
+#include "Model.h"
+#include "MarkerData.h"
+#include "ModelFitter.h"
+#include "C3DTestFile.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char* stream_c3d_filename = "stream_fit_test.c3d";
+const char* stream_model_filename = "stream_fit_test_model.lua";
+const char* stream_animation_filename = "stream_fit_test_animation.csv";
+
+// 255 points and 1000 analog samples per frame give 8080 bytes per frame
+// and a file of 199 MB. Only the first point is written, everything else is
+// a hole of the file (or zeros on file systems without sparse files).
+const int stream_point_count = 255;
+const int stream_analog_channels = 1000;
+const int stream_frame_count = 24576;
+const int stream_data_start_block = 11;
+
+/** Position of the marker M1 at the given frame index in millimeters. */
+void get_stream_marker_position (int frame_index, float *position) {
+	position[0] = 100.f + static_cast<float>(frame_index % 200);
+	position[1] = 200.f;
+	position[2] = 300.f;
+}
+
+/** Writes a C3D file with float point data whose first point is the
+ * marker M1 and that is valid at all frames. */
+bool write_stream_c3d (const char *filename) {
+	C3DHeader header;
+	memset (&header, 0, sizeof(C3DHeader));
+	header.first_parameter = 2;
+	header.c3d_id = 0x50;
+	header.num_markers = stream_point_count;
+	header.analog_channels = stream_analog_channels;
+	header.first_frame = 1;
+	header.last_frame = stream_frame_count;
+	header.scale_factor = -1.f;
+	header.start_record = stream_data_start_block;
+	header.video_sampling_rate = 100.f;
+
+	std::string parameters;
+	ParameterHeader parameter_header = { 1, 0x50, stream_data_start_block - 2, 84 };
+	append_bytes (&parameters, &parameter_header, sizeof(ParameterHeader));
+
+	std::vector<std::string> labels;
+	for (int i = 0; i < stream_point_count; i++) {
+		char label[5];
+		if (i == 0)
+			snprintf (label, sizeof(label), "M1");
+		else
+			snprintf (label, sizeof(label), "P%03d", i);
+		labels.push_back (label);
+	}
+	append_point_parameters (&parameters, labels, stream_data_start_block);
+
+	if (parameters.size() > 512 * (stream_data_start_block - 2))
+		return false;
+
+	int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	size_t frame_size = (stream_point_count * 4 + stream_analog_channels) * sizeof(float);
+	off_t data_start = 512 * (stream_data_start_block - 1);
+
+	bool result = pwrite (fd, &header, sizeof(C3DHeader), 0) == sizeof(C3DHeader)
+		&& pwrite (fd, parameters.data(), parameters.size(), 512) == static_cast<ssize_t>(parameters.size())
+		&& ftruncate (fd, data_start + static_cast<off_t>(frame_size) * stream_frame_count) == 0;
+
+	for (int fi = 0; result && fi < stream_frame_count; fi++) {
+		// the fourth word is zero for a valid point seen by no camera
+		float point_words[4] = { 0.f, 0.f, 0.f, 0.f };
+		get_stream_marker_position (fi, point_words);
+		result = pwrite (fd, point_words, sizeof(point_words), data_start + static_cast<off_t>(frame_size) * fi) == sizeof(point_words);
+	}
+
+	close (fd);
+
+	return result;
+}
+
+/** Writes a model with a single body that can translate freely and carries
+ * the marker M1 at its origin. */
+void write_stream_model (const char *filename) {
+	write_test_model (filename,
+			{ {0, 0, 0, 1, 0, 0}, {0, 0, 0, 0, 1, 0}, {0, 0, 0, 0, 0, 1} },
+			{ {"M1", {0, 0, 0}} });
+}
+
+/** Returns the value in kB of the given field of /proc/self/status or -1
+ * if it is not available. */
+long read_process_status_kb (const char *field) {
+	ifstream status ("/proc/self/status");
+	string line;
+	while (getline (status, line)) {
+		if (line.compare (0, strlen (field), field) == 0) {
+			istringstream value (line.substr (strlen (field)));
+			long result = -1;
+			value >> result;
+			return result;
+		}
+	}
+
+	return -1;
+}
+
+TEST ( TestStreamFitStaysWithinMemoryBudget ) {
+	CHECK (write_stream_c3d (stream_c3d_filename));
+	write_stream_model (stream_model_filename);
+
+	Model model;
+	model.loadFromFile (stream_model_filename);
+
+	MarkerData data;
+	CHECK (data.openFile (stream_c3d_filename));
+	CHECK_EQUAL (1, data.getFirstFrame());
+	CHECK_EQUAL (stream_frame_count, data.getLastFrame());
+
+	SugiharaFitter fitter (&model, &data, 100);
+	fitter.logFormat = FittingLogNone;
+
+	// reset the peak resident set size to the current one (Linux only)
+	bool peak_reset = false;
+	{
+		ofstream clear_refs ("/proc/self/clear_refs");
+		clear_refs << "5" << endl;
+		peak_reset = !clear_refs.fail();
+	}
+	long peak_before = read_process_status_kb ("VmHWM:");
+
+	bool result = fitter.streamModelAnimationFromMarkers (model.modelStateQ, 512, stream_animation_filename);
+	long peak_after = read_process_status_kb ("VmHWM:");
+
+	CHECK (result);
+
+	// Decoding all frames would need 84 MB for the points alone. Without
+	// the peak resident set size the budget cannot be checked which is
+	// reported as a failure.
+	const long memory_budget_kb = 32 * 1024;
+	CHECK (peak_reset);
+	CHECK (peak_before >= 0);
+	CHECK (peak_after >= 0);
+	if (peak_reset && peak_before >= 0 && peak_after >= 0) {
+		CHECK (peak_after - peak_before < memory_budget_kb);
+	} else {
+		cerr << "Error: /proc/self is not available, cannot check the memory used by the stream fit." << endl;
+	}
+
+	// the poses were written for all frames and follow the marker
+	ifstream animation_file (stream_animation_filename);
+	string line;
+	int frame_index = 0;
+	while (getline (animation_file, line)) {
+		if (frame_index % 1000 == 0) {
+			double time, q[3];
+			char separator;
+			istringstream values (line);
+			values >> time >> separator >> q[0] >> separator >> q[1] >> separator >> q[2];
+
+			float position[3];
+			get_stream_marker_position (frame_index, position);
+			CHECK_CLOSE (frame_index / 100., time, 1.0e-6);
+			CHECK_CLOSE (position[0] * 1.0e-3, q[0], 1.0e-4);
+			CHECK_CLOSE (position[1] * 1.0e-3, q[1], 1.0e-4);
+			CHECK_CLOSE (position[2] * 1.0e-3, q[2], 1.0e-4);
+		}
+		frame_index++;
+	}
+	CHECK_EQUAL (stream_frame_count, frame_index);
+
+	remove (stream_c3d_filename);
+	remove (stream_model_filename);
+	remove (stream_animation_filename);
+}